@@ -17,7 +17,9 @@ sub Foxstaub2018viaJeelink_Parse($$);
 sub Foxstaub2018viaJeelink_Initialize($) {
   my ($hash) = @_;
                        # OK CC 71 245 1 128 155 192 48 46 234 0 0 16 0 17
-  $hash->{'Match'}     = '^\S+\s+CC\s+\d+\s+245\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s+\d+\s*$';  # FIXME
+  # 245 = normal frame, 246 = energy telemetry frame, 247 = batched frame,
+  # 248 = v2 (keyframe / delta) frame, 249 = env-only frame (no PM values)
+  $hash->{'Match'}     = '^\S+\s+CC\s+\d+\s+(245|246|247|248|249)(\s+\d+)+\s*$';
   $hash->{'SetFn'}     = "Foxstaub2018viaJeelink_Set";
   ###$hash->{'GetFn'}     = "Foxstaub2018viaJeelink_Get";
   $hash->{'DefFn'}     = "Foxstaub2018viaJeelink_Define";
@@ -127,18 +129,68 @@ sub Foxstaub2018viaJeelink_Set($@) {
   return undef;
 }
 
+#-----------------------------------#
+# Decodes the 12 bytes of measured values that the normal and the batched
+# frames have in common. Returns a hash with the values, invalid ones are
+# set to values outside the plausible range.
+sub Foxstaub2018viaJeelink_DecodeValues(@) {
+  my @b = @_;
+  my %v = ( pressure => 0, temperature => -101.0, relhum => -1.0,
+            pm2_5 => -1.0, pm10 => -1.0, batvolt => -1.0 );
+
+  my $pressraw = (($b[0] << 16) | ($b[1] <<  8) | ($b[2] <<  0));
+  if ($pressraw != 0xffffff) {
+    $v{pressure} = sprintf("%.3f", $pressraw / 4096.0); # in hPa!
+  }
+  my $tempraw = (($b[3] << 8) | ($b[4] << 0));
+  if ($tempraw != 0xffff) {
+    $v{temperature} = sprintf("%.2f", (-45.00 + 175.0 * ($tempraw / 65535.0)));
+    my $humraw = (($b[5] << 8) | ($b[6] << 0));
+    $v{relhum} = sprintf("%.1f", (100.0 * ($humraw / 65535.0)));
+  }
+  $v{pm2_5} = sprintf("%.1f", (($b[7] << 8) | ($b[8] << 0)) / 10.0);
+  $v{pm10} = sprintf("%.1f", (($b[9] << 8) | ($b[10] << 0)) / 10.0);
+  $v{batvolt} = ($b[11] / 100.0) * 11.0;
+  return \%v;
+}
+
+#-----------------------------------#
+# Decodes the zigzag encoded varints of a v2 delta frame. Returns the list
+# of (signed) values, or an empty list if the last one is incomplete.
+sub Foxstaub2018viaJeelink_DecodeVarints(@) {
+  my @b = @_;
+  my @res = ();
+  my $v = 0;
+  my $shift = 0;
+  foreach my $c (@b) {
+    $v |= ($c & 0x7f) << $shift;
+    $shift += 7;
+    if (!($c & 0x80)) {
+      push(@res, ($v & 1) ? -(($v + 1) >> 1) : ($v >> 1));
+      $v = 0;
+      $shift = 0;
+    }
+  }
+  return () if ($shift != 0);
+  return @res;
+}
+
 #-----------------------------------#
 sub Foxstaub2018viaJeelink_Parse($$) {
   my ($hash, $msg) = @_;
   my $name = $hash->{NAME};
 
   my ( @bytes, $addr );
-  my $pressure = 0;
-  my $temperature = -101.0;
-  my $relhum = -1.0;
-  my $pm2_5 = -1.0;
-  my $pm10 = -1.0;
-  my $batvolt = -1.0;
+  # The sets of measured values in this message, oldest first. Each may
+  # have an 'age' in seconds if it was not measured right now.
+  my @values = ();
+  my $firstseq = -1;
+  my @ontimes = ();
+  my $uptime = -1;
+  # For v2 frames
+  my $v2key = -1;
+  my @v2raw = ();
+  my @v2deltas = ();
 
   if ($msg =~ m/^OK CC /) {
     # OK CC 71 245 1 128 155 192 48 46 234 0 0 16 0 17
@@ -159,32 +211,67 @@ sub Foxstaub2018viaJeelink_Parse($$) {
     # Byte 15: PM10, LSB
     @bytes = split( ' ', substr($msg, 6) );
 
-    if (int(@bytes) != 14) {
+    if ((int(@bytes) == 23) && ($bytes[1] == 0xF6)) {
+      # Energy telemetry frame. 6 on-time counters and the uptime, each
+      # in seconds as 24 bit values MSB first, starting at byte 4.
+      $addr = sprintf( "%02x", $bytes[0] );
+      for (my $i = 0; $i < 7; $i++) {
+        my $v = ($bytes[2 + ($i * 3)] << 16) | ($bytes[3 + ($i * 3)] << 8)
+              | ($bytes[4 + ($i * 3)] << 0);
+        if ($i < 6) {
+          push(@ontimes, $v);
+        } else {
+          $uptime = $v;
+        }
+      }
+    } elsif ((int(@bytes) >= 4) && ($bytes[1] == 0xF7)
+          && (int(@bytes) == (4 + ($bytes[3] * 13)))) {
+      # Batched frame: sequence number of the first reading, number of
+      # readings, then for each reading its age in ticks of 2.097152 s
+      # followed by the same 12 bytes as in a normal frame.
+      $addr = sprintf( "%02x", $bytes[0] );
+      $firstseq = $bytes[2];
+      for (my $i = 0; $i < $bytes[3]; $i++) {
+        my $o = 4 + ($i * 13);
+        my $v = Foxstaub2018viaJeelink_DecodeValues(@bytes[($o + 1) .. ($o + 12)]);
+        $v->{age} = $bytes[$o] * 2.097152;
+        push(@values, $v);
+      }
+    } elsif ((int(@bytes) >= 3) && ($bytes[1] == 0xF8)) {
+      # v2 frame: keyframe with the normal 12 bytes, or deltas against the
+      # last keyframe. We can only decode the deltas once we know the
+      # device (and its last keyframe), see below.
+      $addr = sprintf( "%02x", $bytes[0] );
+      $v2key = $bytes[2];
+      if ($v2key & 0x80) {
+        if (int(@bytes) != 15) {
+          DoTrigger($name, "UNKNOWNCODE $msg");
+          return "";
+        }
+        @v2raw = @bytes[3 .. 14];
+      } else {
+        @v2deltas = Foxstaub2018viaJeelink_DecodeVarints(@bytes[3 .. $#bytes]);
+        if (int(@v2deltas) != 6) {
+          DoTrigger($name, "UNKNOWNCODE $msg");
+          return "";
+        }
+      }
+    } elsif ((int(@bytes) == 10) && ($bytes[1] == 0xF9)) {
+      # Env-only frame: like a normal frame, just without the PM values.
+      # Mark those as invalid so they are not updated.
+      $addr = sprintf( "%02x", $bytes[0] );
+      push(@values, Foxstaub2018viaJeelink_DecodeValues(@bytes[2 .. 8],
+                                                        0xff, 0xff, 0xff, 0xff,
+                                                        $bytes[9]));
+    } elsif ((int(@bytes) != 14) || ($bytes[1] != 0xF5)) {
       DoTrigger($name, "UNKNOWNCODE $msg");
       return "";
-    }
-    if ($bytes[1] != 0xF5) {
-      DoTrigger($name, "UNKNOWNCODE $msg");
-      return "";
-    }
+    } else {
+      #Log3 $name, 3, "$name: $msg cnt ".int(@bytes)." addr ".$bytes[0];
 
-    #Log3 $name, 3, "$name: $msg cnt ".int(@bytes)." addr ".$bytes[0];
-
-    $addr = sprintf( "%02x", $bytes[0] );
-    my $pressraw = (($bytes[2] << 16)
-                  | ($bytes[3] <<  8) | ($bytes[4] <<  0));
-    if ($pressraw != 0xffffff) {
-      $pressure = sprintf("%.3f", $pressraw / 4096.0); # in hPa!
-    }
-    my $tempraw = (($bytes[5] << 8) | ($bytes[6] << 0));
-    if ($tempraw != 0xffff) {
-      $temperature = sprintf("%.2f", (-45.00 + 175.0 * ($tempraw / 65535.0)));
-      my $humraw = (($bytes[7] << 8) | ($bytes[8] << 0));
-      $relhum = sprintf("%.1f", (100.0 * ($humraw / 65535.0)));
+      $addr = sprintf( "%02x", $bytes[0] );
+      push(@values, Foxstaub2018viaJeelink_DecodeValues(@bytes[2 .. 13]));
     }
-    $pm2_5 = sprintf("%.1f", (($bytes[9] << 8) | ($bytes[10] << 0)) / 10.0);
-    $pm10 = sprintf("%.1f", (($bytes[11] << 8) | ($bytes[12] << 0)) / 10.0);
-    $batvolt = ($bytes[13] / 100.0) * 11.0;
   } else {
     DoTrigger($name, "UNKNOWNCODE $msg");
     return "";
@@ -222,30 +309,112 @@ sub Foxstaub2018viaJeelink_Parse($$) {
   $rhash->{"Foxstaub2018viaJeelink_lastRcv"} = TimeNow();
   $rhash->{"sensorType"} = "Foxstaub2018viaJeelink";
 
-  readingsBeginUpdate($rhash);
-
-  # What is it good for? I haven't got the slightest clue, and the FHEM docu
-  # about it could just as well be in Russian, it's absolutely not understandable
-  # (at least for non-seasoned FHEM developers) what this is actually used for.
-  readingsBulkUpdate($rhash, "state", "Initialized");
-  # Round and write temperature and humidity
-  if ($pressure > 100.0) { # Could be valid
-    readingsBulkUpdate($rhash, "pressure", $pressure);
+  if ($v2key >= 0) {
+    if ($v2key & 0x80) {
+      # Keyframe: remember its raw bytes for the following delta frames
+      $rhash->{"Foxstaub2018viaJeelink_keyNum"} = $v2key & 0x7f;
+      $rhash->{"Foxstaub2018viaJeelink_keyRaw"} = [ @v2raw ];
+    } elsif (defined($rhash->{"Foxstaub2018viaJeelink_keyNum"})
+          && ($rhash->{"Foxstaub2018viaJeelink_keyNum"} == $v2key)) {
+      # Delta frame: add the deltas to the keyframe values, modulo their
+      # field width, and turn them back into the 12 bytes of a normal frame.
+      my @k = @{$rhash->{"Foxstaub2018viaJeelink_keyRaw"}};
+      my $p = ((($k[0] << 16) | ($k[1] << 8) | $k[2]) + $v2deltas[0]) & 0xffffff;
+      my @f = ( ((($k[3] << 8) | $k[4]) + $v2deltas[1]) & 0xffff,
+                ((($k[5] << 8) | $k[6]) + $v2deltas[2]) & 0xffff,
+                ((($k[7] << 8) | $k[8]) + $v2deltas[3]) & 0xffff,
+                ((($k[9] << 8) | $k[10]) + $v2deltas[4]) & 0xffff );
+      @v2raw = ( ($p >> 16) & 0xff, ($p >> 8) & 0xff, $p & 0xff );
+      foreach my $x (@f) {
+        push(@v2raw, ($x >> 8) & 0xff, $x & 0xff);
+      }
+      push(@v2raw, ($k[11] + $v2deltas[5]) & 0xff);
+    } else {
+      # We missed the keyframe these deltas refer to
+      Log3 $rname, 4, "Foxstaub2018viaJeelink: $rname: delta frame for unknown keyframe $v2key dropped";
+      $rhash->{"Foxstaub2018viaJeelink_undecodable"} += 1;
+    }
+    if (int(@v2raw) == 12) {
+      push(@values, Foxstaub2018viaJeelink_DecodeValues(@v2raw));
+    }
   }
-  if (($temperature > -100.0) && ($temperature < 100.0)) { # Could be valid
-    readingsBulkUpdate($rhash, "temperature", $temperature);
+
+  if ($firstseq >= 0) {
+    # Batched frame: Check which readings we missed. Readings we have
+    # already seen (e.g. received through two JeeLinks) are dropped.
+    my $expected = $rhash->{"Foxstaub2018viaJeelink_nextSeq"};
+    my $seq = $firstseq;
+    my @fresh = ();
+    foreach my $v (@values) {
+      my $diff = defined($expected) ? (($seq - $expected) & 0xff) : 0;
+      if ($diff < 128) {
+        if ($diff > 0) {
+          $rhash->{"Foxstaub2018viaJeelink_lost"} += $diff;
+        }
+        push(@fresh, $v);
+        $expected = ($seq + 1) & 0xff;
+      }
+      $seq = ($seq + 1) & 0xff;
+    }
+    $rhash->{"Foxstaub2018viaJeelink_nextSeq"} = $expected;
+    @values = @fresh;
   }
-  if (($relhum >= 0.0) && ($relhum <= 100.0)) { # Could be valid
-    readingsBulkUpdate($rhash, "humidity", $relhum);
+
+  my $now = time();
+  foreach my $v (@values) {
+    readingsBeginUpdate($rhash);
+    if (defined($v->{age}) && ($v->{age} > 0)) {
+      # Older reading from a batch, backdate it.
+      $rhash->{".updateTime"} = $now - $v->{age};
+      $rhash->{".updateTimestamp"} = FmtDateTime($now - $v->{age});
+    }
+
+    # What is it good for? I haven't got the slightest clue, and the FHEM docu
+    # about it could just as well be in Russian, it's absolutely not understandable
+    # (at least for non-seasoned FHEM developers) what this is actually used for.
+    readingsBulkUpdate($rhash, "state", "Initialized");
+    # Round and write temperature and humidity
+    if ($v->{pressure} > 100.0) { # Could be valid
+      readingsBulkUpdate($rhash, "pressure", $v->{pressure});
+    }
+    if (($v->{temperature} > -100.0) && ($v->{temperature} < 100.0)) { # Could be valid
+      readingsBulkUpdate($rhash, "temperature", $v->{temperature});
+    }
+    if (($v->{relhum} >= 0.0) && ($v->{relhum} <= 100.0)) { # Could be valid
+      readingsBulkUpdate($rhash, "humidity", $v->{relhum});
+    }
+    if (($v->{pm2_5} >= 0) && ($v->{pm2_5} < 1000)) { # This is the sensors range
+      readingsBulkUpdate($rhash, "pm2_5", $v->{pm2_5});
+    }
+    if (($v->{pm10} >= 0) && ($v->{pm10} < 1000)) { # This is the sensors range
+      readingsBulkUpdate($rhash, "pm10", $v->{pm10});
+    }
+    if (($v->{batvolt} > 0.0) && ($v->{batvolt} < 25.0)) { # Could be valid
+      readingsBulkUpdate($rhash, "batvolt", $v->{batvolt});
+    }
+    readingsEndUpdate($rhash,1);
   }
-  if (($pm2_5 >= 0) && ($pm2_5 < 1000)) { # This is the sensors range
-    readingsBulkUpdate($rhash, "pm2_5", $pm2_5);
+
+  readingsBeginUpdate($rhash);
+  if (defined($rhash->{"Foxstaub2018viaJeelink_undecodable"})) {
+    readingsBulkUpdate($rhash, "undecodable_frames", $rhash->{"Foxstaub2018viaJeelink_undecodable"});
   }
-  if (($pm10 >= 0) && ($pm10 < 1000)) { # This is the sensors range
-    readingsBulkUpdate($rhash, "pm10", $pm10);
+  if ($firstseq >= 0) {
+    readingsBulkUpdate($rhash, "lost_readings", $rhash->{"Foxstaub2018viaJeelink_lost"} // 0);
   }
-  if (($batvolt > 0.0) && ($batvolt < 25.0)) { # Could be valid
-    readingsBulkUpdate($rhash, "batvolt", $batvolt);
+  if (int(@ontimes) == 6) {
+    # Same order and rough current draws (in mA) as in energy.h
+    my @onnames = ("sds011", "radiostby", "radiotx", "adc", "twi", "cpu");
+    my @onmas = (70.0, 1.25, 45.0, 0.3, 1.0, 10.0);
+    my $mah = 0.0;
+    for (my $i = 0; $i < 6; $i++) {
+      readingsBulkUpdate($rhash, "ontime_" . $onnames[$i], $ontimes[$i]);
+      $mah += ($ontimes[$i] * $onmas[$i]) / 3600.0;
+    }
+    readingsBulkUpdate($rhash, "uptime", $uptime);
+    if ($uptime > 0) {
+      readingsBulkUpdate($rhash, "est_mAh_per_day", sprintf("%.1f", ($mah * 86400.0) / $uptime));
+    }
   }
 
   readingsEndUpdate($rhash,1);
@@ -315,6 +484,20 @@ sub Foxstaub2018viaJeelink_Parse($$) {
       Particulate Matter 2.5 micro-meter value from the SDS011 dust sensor</li>
     <li>batvolt (V)<br>
       the battery voltage of the battery in volts.</li>
+    <li>ontime_sds011, ontime_radiostby, ontime_radiotx, ontime_adc, ontime_twi, ontime_cpu, uptime<br>
+      only if the sensor was compiled with ENERGYTELEMETRY: how many seconds
+      the respective part was turned on since the sensor booted.</li>
+    <li>est_mAh_per_day<br>
+      estimated consumption from the on-times above (without sleep currents).</li>
+    <li>undecodable_frames<br>
+      only if the sensor was compiled with PAYLOADV2: how many delta frames
+      had to be dropped because the keyframe they refer to was not
+      received.</li>
+    <li>lost_readings<br>
+      only if the sensor was compiled with BATCHEDFRAMES: how many readings
+      were lost according to the sequence numbers, since FHEM was started.
+      The values from batched frames get the time they were measured as
+      their timestamp, not the time they were received.</li>
   </ul><br>
 
   <a name="Foxstaub2018viaJeelink_Attr"></a>
@@ -5,6 +5,7 @@
 #include <avr/io.h>
 #include <avr/power.h>
 #include "adc.h"
+#include "energy.h"
 
 void adc_init(void)
 {
@@ -22,10 +23,12 @@ void adc_power(uint8_t p)
     /* Select reference voltage (internal 2.56V) and pin A3 on the feather
      * (which is ADC4, hooray for consistency!) */
     ADMUX = _BV(REFS0) | _BV(REFS1) | 4;
+    energy_on(ENERGY_ADC);
   } else {
     /* Send ADC to sleep */
     ADCSRA &= (uint8_t)~_BV(ADEN);
     PRR0 |= _BV(PRADC);
+    energy_off(ENERGY_ADC);
   }
 }
 
@@ -0,0 +1,24 @@
+/* $Id: crc8.c $
+ * The CRC8 (polynomial 0x31) our frames, the ACKs and the beacons use.
+ */
+
+#include <avr/io.h>
+#include "crc8.h"
+
+uint8_t crc8_calc(const uint8_t * data, uint8_t len)
+{
+  uint8_t i, j;
+  uint8_t res = 0;
+  for (j = 0; j < len; j++) {
+    uint8_t val = data[j];
+    for (i = 0; i < 8; i++) {
+      uint8_t tmp = (uint8_t)((res ^ val) & 0x80);
+      res <<= 1;
+      if (0 != tmp) {
+        res ^= 0x31;
+      }
+      val <<= 1;
+    }
+  }
+  return res;
+}
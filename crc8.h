@@ -0,0 +1,10 @@
+/* $Id: crc8.h $
+ * The CRC8 (polynomial 0x31) our frames, the ACKs and the beacons use.
+ */
+
+#ifndef _CRC8_H_
+#define _CRC8_H_
+
+uint8_t crc8_calc(const uint8_t * data, uint8_t len);
+
+#endif /* _CRC8_H_ */
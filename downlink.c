@@ -0,0 +1,82 @@
+/* $Id: downlink.c $
+ * Configuration commands from the gateway, received right after we sent
+ * something.
+ *
+ * After each frame, we listen for a short time. If the gateway has new
+ * settings for us, it sends them in this format (fixed 10 bytes):
+ * Byte 0: 0xCF
+ * Byte 1: Sensor ID the command is for, 0xff for all sensors
+ * Byte 2: Sequence number. A command is only applied if this differs from
+ *         the one of the command applied last, so the gateway can just
+ *         keep repeating it for a while to make sure it reaches everybody.
+ * Byte 3: Average transmit interval in ticks of 2.1 s (2 - 255)
+ * Byte 4: Length of an SDS011 cycle in ticks, MSB (at most 16383, so it
+ *         still fits our timers when the power policy stretches it)
+ * Byte 5: Length of an SDS011 cycle in ticks, LSB
+ * Byte 6: Maximum SDS011 on-time per cycle in ticks
+ * Byte 7: Transmit power in dBm (-2 - 13), signed
+ * Byte 8: Reserved (0)
+ * Byte 9: CRC8 over bytes 0 - 8
+ * A value of 0 in bytes 3 - 6 and 0x7f in byte 7 means "leave unchanged".
+ * The SDS011 on-time must be shorter than its cycle, else the whole
+ * command is ignored.
+ */
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include "crc8.h"
+#include "downlink.h"
+#include "eeprom.h"
+#include "rfm69.h"
+
+#if defined(DOWNLINKCONFIG)
+
+#define CMDLEN 10
+#define CMDMARKER 0xCF
+#define KEEPDBM 0x7f
+
+extern uint8_t sensorid;
+
+uint8_t downlink_checksettings(const struct nodesettings * n)
+{
+  return ((n->txinterval >= 2) && (n->sdscyclelength <= DOWNLINK_MAXCYCLELENGTH)
+       && (n->sdscycleontime > 0) && (n->sdscycleontime < n->sdscyclelength)
+       && (n->txdbm >= RFM69_MINDBM) && (n->txdbm <= RFM69_MAXDBM));
+}
+
+uint8_t downlink_listen(struct nodesettings * s)
+{
+  uint8_t c[CMDLEN];
+  struct nodesettings n;
+  if ((!rfm69_receive(c, CMDLEN, DOWNLINK_WINDOWMS))
+   || (c[0] != CMDMARKER) || ((c[1] != sensorid) && (c[1] != 0xff))
+   || (crc8_calc(c, CMDLEN - 1) != c[CMDLEN - 1])) {
+    return 0;
+  }
+  if (c[2] == s->seq) { /* Already applied that one */
+    return 0;
+  }
+  n = *s;
+  n.seq = c[2];
+  if (c[3] != 0) {
+    n.txinterval = c[3];
+  }
+  if ((c[4] != 0) || (c[5] != 0)) {
+    n.sdscyclelength = ((uint16_t)c[4] << 8) | c[5];
+  }
+  if (c[6] != 0) {
+    n.sdscycleontime = c[6];
+  }
+  if (c[7] != KEEPDBM) {
+    n.txdbm = (int8_t)c[7];
+  }
+  if (!downlink_checksettings(&n)) {
+    return 0; /* Nonsense, do not brick the sensor with it */
+  }
+  n.crc = crc8_calc((uint8_t *)&n, sizeof(n) - 1);
+  *s = n;
+  eeprom_update_block(&n, &ee_settings, sizeof(n));
+  return 1;
+}
+
+#endif /* DOWNLINKCONFIG */
@@ -0,0 +1,27 @@
+/* $Id: downlink.h $
+ * Configuration commands from the gateway, received right after we sent
+ * something.
+ */
+
+#ifndef _DOWNLINK_H_
+#define _DOWNLINK_H_
+
+struct nodesettings; /* see eeprom.h */
+
+/* How long we listen for a command after each frame */
+#define DOWNLINK_WINDOWMS 30
+
+/* The longest SDS011 cycle we accept, in ticks. Stretched by the power
+ * policy (at most 4 times), that is still less than 65536 ticks. */
+#define DOWNLINK_MAXCYCLELENGTH 16383
+
+/* Are these settings sane? Used for the ones from the gateway as well as
+ * for the ones loaded from the EEPROM. */
+uint8_t downlink_checksettings(const struct nodesettings * n);
+
+/* Listen for a configuration command. If one for us arrives, it gets
+ * applied to *s and saved to the EEPROM, and we return 1. The radio must be
+ * in standby, and is back in standby afterwards. */
+uint8_t downlink_listen(struct nodesettings * s);
+
+#endif /* _DOWNLINK_H_ */
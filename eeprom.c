@@ -12,4 +12,13 @@
 /* Do not set these directly, set the define above */
 EEMEM uint8_t ee_sensorid = THESENSORID;
 EEMEM uint8_t ee_invsensorid = THESENSORID ^ 0xff;
+/* The radio profile (see rfm69.c). 0xff means: use the one the firmware
+ * was compiled with (-DRADIOPROFILE=n, default 0). */
+#define THERADIOPROFILE 0xff
+EEMEM uint8_t ee_radioprofile = THERADIOPROFILE;
+EEMEM uint8_t ee_invradioprofile = THERADIOPROFILE ^ 0xff;
 
+#if defined(DOWNLINKCONFIG)
+/* Not set by default, the gateway sends them */
+EEMEM struct nodesettings ee_settings = { 0xff, 0xff, 0xffff, 0xff, -1, 0xff };
+#endif /* DOWNLINKCONFIG */
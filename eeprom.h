@@ -9,5 +9,23 @@
 
 extern EEMEM uint8_t ee_sensorid;
 extern EEMEM uint8_t ee_invsensorid; /* This is used as a sort of "CRC" */
+/* Radio profile (see rfm69.c), overrides the one we were compiled with */
+extern EEMEM uint8_t ee_radioprofile;
+extern EEMEM uint8_t ee_invradioprofile;
+
+#if defined(DOWNLINKCONFIG)
+/* Settings the gateway can change over the air (see downlink.c). These are
+ * only used if the CRC matches, so the erased state (all 0xff) means "use
+ * the compiled in defaults". */
+struct nodesettings {
+  uint8_t seq;              /* Sequence number of the last applied command */
+  uint8_t txinterval;       /* Average transmit interval, in ticks */
+  uint16_t sdscyclelength;  /* Length of an SDS011 cycle, in ticks */
+  uint8_t sdscycleontime;   /* Maximum SDS011 on-time per cycle, in ticks */
+  int8_t txdbm;             /* Transmit power (maximum with ACKEDUPLINK) */
+  uint8_t crc;              /* CRC8 over the bytes above */
+};
+extern EEMEM struct nodesettings ee_settings;
+#endif /* DOWNLINKCONFIG */
 
 #endif /* _EEPROM_H_ */
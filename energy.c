@@ -0,0 +1,80 @@
+/* $Id: energy.c $
+ * Energy accounting: Keeps track of how long the power hungry parts of the
+ * sensor were turned on, so we can estimate the power consumption.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "energy.h"
+#include "timers.h"
+
+#define COUNTSPERSEC 31250U
+
+/* Accumulated on-time, as full seconds plus a fraction in TIMER1 counts,
+ * because TIMER1 counts alone would overflow after 38 hours. */
+static uint32_t ensecs[ENERGY_NUMCOUNTERS];
+static uint16_t enfrac[ENERGY_NUMCOUNTERS];
+/* When the currently running ones were turned on (timers_getcounts()) */
+static uint32_t enstart[ENERGY_NUMCOUNTERS];
+static uint8_t enrunning = 0;
+
+static void addcounts(uint8_t which, uint32_t counts)
+{
+  ensecs[which] += counts / COUNTSPERSEC;
+  enfrac[which] += counts % COUNTSPERSEC;
+  if (enfrac[which] >= COUNTSPERSEC) {
+    enfrac[which] -= COUNTSPERSEC;
+    ensecs[which]++;
+  }
+}
+
+void energy_on(uint8_t which)
+{
+  uint8_t sreg = SREG;
+  cli();
+  if (!(enrunning & _BV(which))) {
+    enstart[which] = timers_getcounts();
+    enrunning |= _BV(which);
+  }
+  SREG = sreg;
+}
+
+void energy_off(uint8_t which)
+{
+  uint8_t sreg = SREG;
+  cli();
+  if (enrunning & _BV(which)) {
+    addcounts(which, timers_getcounts() - enstart[which]);
+    enrunning &= (uint8_t)~_BV(which);
+  }
+  SREG = sreg;
+}
+
+void energy_add(uint8_t which, uint32_t ms)
+{
+  uint8_t sreg = SREG;
+  cli();
+  addcounts(which, TIMERS_MS(ms));
+  SREG = sreg;
+}
+
+void energy_get(uint8_t which, uint32_t * secs, uint16_t * ms)
+{
+  uint32_t frac;
+  uint8_t sreg = SREG;
+  cli();
+  *secs = ensecs[which];
+  frac = enfrac[which];
+  if (enrunning & _BV(which)) { /* Add what the current run has used so far */
+    uint32_t cur = timers_getcounts() - enstart[which];
+    *secs += cur / COUNTSPERSEC;
+    frac += cur % COUNTSPERSEC;
+  }
+  SREG = sreg;
+  if (frac >= COUNTSPERSEC) {
+    frac -= COUNTSPERSEC;
+    (*secs)++;
+  }
+  /* 1 count = 32 us = 4/125 ms */
+  *ms = (frac * 4) / 125;
+}
@@ -0,0 +1,43 @@
+/* $Id: energy.h $
+ * Energy accounting: Keeps track of how long the power hungry parts of the
+ * sensor were turned on, so we can estimate the power consumption.
+ */
+
+#ifndef _ENERGY_H_
+#define _ENERGY_H_
+
+/* The things we keep track of */
+#define ENERGY_SDS011     0  /* SDS011 measuring (fan and laser on) */
+#define ENERGY_RADIOSTBY  1  /* RFM69 in standby (oscillator running) */
+#define ENERGY_RADIOTX    2  /* RFM69 transmitting */
+#define ENERGY_ADC        3  /* ADC powered */
+#define ENERGY_TWI        4  /* TWI transaction running */
+#define ENERGY_CPU        5  /* CPU awake, i.e. not sleeping */
+#define ENERGY_RADIORX    6  /* RFM69 receiving */
+#define ENERGY_NUMCOUNTERS 7
+
+/* Typical current draw of these while on, in uA, for estimating the
+ * consumption. These are rough values from the datasheets. */
+#define ENERGY_UA_SDS011    70000UL
+#define ENERGY_UA_RADIOSTBY  1250UL
+#define ENERGY_UA_RADIOTX   45000UL  /* at +13 dBm, the maximum */
+#define ENERGY_UA_ADC         300UL
+#define ENERGY_UA_TWI        1000UL
+#define ENERGY_UA_CPU       10000UL
+#define ENERGY_UA_RADIORX   16000UL
+
+/* Mark something as turned on or off. Turning on something that is already
+ * on (or off something that is already off) is harmless.
+ * These can be called with interrupts enabled or disabled. */
+void energy_on(uint8_t which);
+void energy_off(uint8_t which);
+
+/* Account for something that was on for 'ms' milliseconds without us
+ * seeing it being turned on and off (e.g. the SDS011 running its own
+ * working period). Can be called with interrupts enabled or disabled. */
+void energy_add(uint8_t which, uint32_t ms);
+
+/* Get the total on-time since boot, as seconds and milliseconds. */
+void energy_get(uint8_t which, uint32_t * secs, uint16_t * ms);
+
+#endif /* _ENERGY_H_ */
@@ -0,0 +1,80 @@
+/* $Id: frame.c $
+ * Building the frames we send, with bounds checking.
+ */
+
+#include <avr/io.h>
+#include "crc8.h"
+#include "frame.h"
+
+extern uint8_t sensorid;
+
+void frame_beginraw(struct framebuilder * f, uint8_t * buf, uint8_t size)
+{
+  f->buf = buf;
+  f->size = size;
+  f->len = 0;
+  f->overflow = 0;
+}
+
+void frame_begin(struct framebuilder * f, uint8_t * buf, uint8_t size, uint8_t type)
+{
+  frame_beginraw(f, buf, size);
+  frame_put8(f, 0xCC);
+  frame_put8(f, sensorid);
+  frame_put8(f, 0); /* Length, filled in by frame_finish() */
+  frame_put8(f, type);
+}
+
+void frame_put8(struct framebuilder * f, uint8_t v)
+{
+  if (f->len >= f->size) {
+    f->overflow = 1;
+    return;
+  }
+  f->buf[f->len++] = v;
+}
+
+void frame_put16(struct framebuilder * f, uint16_t v)
+{
+  frame_put8(f, (v >> 8) & 0xff);
+  frame_put8(f, (v >> 0) & 0xff);
+}
+
+void frame_put24(struct framebuilder * f, uint32_t v)
+{
+  frame_put8(f, (v >> 16) & 0xff);
+  frame_put8(f, (v >>  8) & 0xff);
+  frame_put8(f, (v >>  0) & 0xff);
+}
+
+void frame_putbytes(struct framebuilder * f, const uint8_t * data, uint8_t len)
+{
+  for (uint8_t i = 0; i < len; i++) {
+    frame_put8(f, data[i]);
+  }
+}
+
+void frame_putvarint(struct framebuilder * f, int32_t v)
+{
+  uint32_t zz = ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+  while (zz >= 0x80) {
+    frame_put8(f, (zz & 0x7f) | 0x80);
+    zz >>= 7;
+  }
+  frame_put8(f, zz);
+}
+
+uint8_t frame_finish(struct framebuilder * f)
+{
+  if (f->len < 4) { /* Not even the header fit */
+    return 0;
+  }
+  f->buf[2] = f->len - 3;
+#if !defined(HWPACKET)
+  frame_put8(f, crc8_calc(f->buf, f->len));
+#endif /* !HWPACKET */
+  if (f->overflow) {
+    return 0;
+  }
+  return f->len;
+}
@@ -0,0 +1,42 @@
+/* $Id: frame.h $
+ * Building the frames we send, with bounds checking.
+ */
+
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+/* All our frames use the "CustomSensor" header from the LaCrosseItPlusReader
+ * sketch: Startbyte 0xCC, sensor ID, number of data bytes that follow (CRC
+ * not counted), sensor type. The frame builder writes that header, and in
+ * the end fills in the length and appends the CRC8 - unless the radio does
+ * the CRC itself (HWPACKET). */
+struct framebuilder {
+  uint8_t * buf;
+  uint8_t size;       /* Size of buf */
+  uint8_t len;        /* Bytes written so far */
+  uint8_t overflow;   /* Set when something did not fit into buf */
+};
+
+/* Start a frame of the given sensor type in buf */
+void frame_begin(struct framebuilder * f, uint8_t * buf, uint8_t size, uint8_t type);
+
+/* Start filling buf with just the values, without the header. Such a
+ * buffer is not a frame, so no frame_finish() either. */
+void frame_beginraw(struct framebuilder * f, uint8_t * buf, uint8_t size);
+
+/* Append values, MSB first. Anything that does not fit is dropped and
+ * marks the frame as overflowed. */
+void frame_put8(struct framebuilder * f, uint8_t v);
+void frame_put16(struct framebuilder * f, uint16_t v);
+void frame_put24(struct framebuilder * f, uint32_t v);
+void frame_putbytes(struct framebuilder * f, const uint8_t * data, uint8_t len);
+/* Append a signed value as zigzag encoded varint: The sign goes into
+ * bit 0, so small negative numbers stay small, and then 7 bits per byte,
+ * least significant first, with bit 7 set if more bytes follow. */
+void frame_putvarint(struct framebuilder * f, int32_t v);
+
+/* Fill in the length and the CRC. Returns the length of the whole frame,
+ * or 0 if it overflowed (and must not be sent). */
+uint8_t frame_finish(struct framebuilder * f);
+
+#endif /* _FRAME_H_ */
@@ -0,0 +1,80 @@
+/* $Id: irqstats.c $
+ * Interrupt latency instrumentation (only with -DIRQLATENCY): How long our
+ * interrupt handlers take, and how long interrupts have to wait before
+ * they get handled, i.e. how long interrupts were disabled.
+ *
+ * The handlers measure themselves with TCNT1 (see IRQSTATS_ISRSTART()).
+ * For the time interrupts are disabled, we do not instrument every
+ * cli()/sei() pair. Instead, a probe interrupt (TIMER1 compare C) fires
+ * every 8 ms, and looks at how late it runs: That is the time the
+ * interrupts were disabled, or some other handler was running, when it
+ * became due. This is sampling, so short critical sections are
+ * underrepresented, but anything that blocks interrupts for long (which is
+ * what loses UART bytes) shows up reliably. The probe does not run in
+ * power-down sleep, where TIMER1 is stopped.
+ * All this touches TIMER1 from interrupt context, which relies on main code
+ * only ever accessing TIMER1 with interrupts disabled (see timers.c).
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "irqstats.h"
+
+#if defined(IRQLATENCY)
+
+/* Interval of the probe interrupt in TIMER1 counts */
+#define PROBECOUNTS 250 /* 8 ms */
+
+static struct irqstat stats[IRQSTAT_NUM];
+
+ISR(TIMER1_COMPC_vect)
+{
+  uint16_t now = TCNT1;
+  irqstats_add_noirq(IRQSTAT_LATENCY, now - OCR1C);
+  OCR1C = now + PROBECOUNTS;
+}
+
+void irqstats_init(void)
+{
+  uint8_t sreg = SREG;
+  cli();
+  OCR1C = TCNT1 + PROBECOUNTS;
+  TIFR1 = _BV(OCF1C); /* Clear stale flag */
+  TIMSK1 |= _BV(OCIE1C);
+  SREG = sreg;
+}
+
+void irqstats_add_noirq(uint8_t which, uint16_t counts)
+{
+  struct irqstat * s = &stats[which];
+  uint8_t b = 0;
+  if (counts > s->max) {
+    s->max = counts;
+  }
+  s->num++;
+  while ((counts > 0) && (b < (IRQSTAT_NUMBUCKETS - 1))) {
+    counts >>= 1;
+    b++;
+  }
+  if (s->hist[b] < 0xffff) {
+    s->hist[b]++;
+  }
+}
+
+void irqstats_get_noirq(uint8_t which, struct irqstat * s)
+{
+  *s = stats[which];
+}
+
+void irqstats_reset_noirq(void)
+{
+  for (uint8_t i = 0; i < IRQSTAT_NUM; i++) {
+    stats[i].max = 0;
+    stats[i].num = 0;
+    for (uint8_t b = 0; b < IRQSTAT_NUMBUCKETS; b++) {
+      stats[i].hist[b] = 0;
+    }
+  }
+}
+
+#endif /* IRQLATENCY */
@@ -0,0 +1,60 @@
+/* $Id: irqstats.h $
+ * Interrupt latency instrumentation (only with -DIRQLATENCY): How long our
+ * interrupt handlers take, and how long interrupts have to wait before
+ * they get handled, i.e. how long interrupts were disabled.
+ */
+
+#ifndef _IRQSTATS_H_
+#define _IRQSTATS_H_
+
+/* What we keep statistics for */
+#define IRQSTAT_USART1RX  0  /* SDS011 RX */
+#define IRQSTAT_USART1TX  1  /* SDS011 TX */
+#define IRQSTAT_TIMER1OVF 2
+#define IRQSTAT_USB       3  /* USB_GEN and USB_COM */
+#define IRQSTAT_LATENCY   4  /* Latency of the probe interrupt, see irqstats.c */
+#define IRQSTAT_NUM       5
+
+/* All times are in TIMER1 counts of 32 us. Histogram bucket 0 is for
+ * 0 counts (less than 32 us), bucket n for 2^(n-1) to 2^n - 1 counts, and
+ * the last one for everything longer. */
+#define IRQSTAT_NUMBUCKETS 8
+struct irqstat {
+  uint16_t max;
+  uint32_t num;
+  uint16_t hist[IRQSTAT_NUMBUCKETS]; /* These stop at 65535 */
+};
+
+#if defined(IRQLATENCY)
+/* Put IRQSTATS_ISRSTART() at the very beginning of an interrupt handler,
+ * and IRQSTATS_ISREND(which) at its end.
+ * Reading TCNT1 (and writing OCR1C in the probe) goes through the TEMP
+ * register shared by all 16 bit TIMER1 accesses. That is only harmless
+ * because main code never accesses TIMER1 with interrupts enabled (see
+ * readsnapshot() in timers.c). Some handlers (USB_COM) enable interrupts
+ * again, so the reads here disable them too. */
+static inline uint16_t irqstats_readtcnt1(void)
+{
+  uint16_t res;
+  uint8_t sreg = SREG;
+  cli();
+  res = TCNT1;
+  SREG = sreg;
+  return res;
+}
+#define IRQSTATS_ISRSTART() uint16_t irqstats_t0 = irqstats_readtcnt1()
+#define IRQSTATS_ISREND(which) irqstats_add_noirq((which), irqstats_readtcnt1() - irqstats_t0)
+
+/* Start the latency probe. TIMER1 must have been initialized. */
+void irqstats_init(void);
+/* Account for something that took 'counts' TIMER1 counts */
+void irqstats_add_noirq(uint8_t which, uint16_t counts);
+/* Fetch and reset statistics. Call with interrupts disabled. */
+void irqstats_get_noirq(uint8_t which, struct irqstat * s);
+void irqstats_reset_noirq(void);
+#else /* IRQLATENCY */
+#define IRQSTATS_ISRSTART()
+#define IRQSTATS_ISREND(which)
+#endif /* IRQLATENCY */
+
+#endif /* _IRQSTATS_H_ */
@@ -0,0 +1,114 @@
+/* $Id: lowpower.c $
+ * Functions for sending the MCU to sleep as deeply as currently possible.
+ *
+ * SLEEP_MODE_IDLE keeps TIMER1, the USART and USB running, but costs quite a
+ * bit of power. SLEEP_MODE_PWR_DOWN stops all clocks, so we only use it when
+ * nobody needs them: No USB host talking to us, and no pending communication
+ * with the SDS011. The watchdog keeps the time while we are in power-down.
+ * Either way, we only wake up when the next scheduled job is due (or some
+ * IRQ needs handling), not on every tick.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include "energy.h"
+#include "lowpower.h"
+#include "lufa/console.h"
+#include "rfm69.h"
+#include "sds011.h"
+#include "timers.h"
+#include "twi.h"
+
+#if defined(SLEEPSTATS)
+/* Time spent in each state. Kept as full seconds plus a fraction in TIMER1
+ * counts, because TIMER1 counts alone would overflow after 38 hours. */
+#define COUNTSPERSEC 31250U
+static uint32_t statsecs[3];
+static uint16_t statfrac[3];
+static uint32_t statnumsleeps[3];
+static uint32_t lastwakeup = 0;
+
+static void addtostat(uint8_t which, uint32_t counts)
+{
+  statsecs[which] += counts / COUNTSPERSEC;
+  statfrac[which] += counts % COUNTSPERSEC;
+  if (statfrac[which] >= COUNTSPERSEC) {
+    statfrac[which] -= COUNTSPERSEC;
+    statsecs[which]++;
+  }
+}
+
+void lowpower_getstats_noirq(struct sleepstats * s)
+{
+  s->awakesecs = statsecs[SLEEPSTAT_AWAKE];
+  s->idlesecs = statsecs[SLEEPSTAT_IDLE];
+  s->pwrdownsecs = statsecs[SLEEPSTAT_PWRDOWN];
+  s->numidle = statnumsleeps[SLEEPSTAT_IDLE];
+  s->numpwrdown = statnumsleeps[SLEEPSTAT_PWRDOWN];
+}
+#endif /* SLEEPSTATS */
+
+void lowpower_sleep(void)
+{
+  uint8_t pwrdown = 0;
+  uint32_t untilnext;
+#if defined(SLEEPSTATS)
+  uint32_t sleepstart;
+  uint32_t sleepend;
+#endif
+
+  cli();
+  untilnext = timers_untilnextjob_noirq();
+  if ((untilnext == 0) || sds011_haspendingrx_noirq()) {
+    /* Something is due right now, no point in sleeping */
+    sei();
+    return;
+  }
+  if (console_isusbsuspended() && !sds011_isbusy_noirq() && !twi_isbusy_noirq()
+#if defined(RFM69_RX)
+   && !rfm69_isrxactive_noirq()
+#endif /* RFM69_RX */
+     ) {
+    /* Only go to power-down if the next job is far enough away for the
+     * watchdog to time it, else TIMER1 needs to keep running. */
+    pwrdown = timers_armwdtwakeup_noirq(untilnext);
+  }
+  if (pwrdown) {
+    sds011_setwakeup_noirq(1);
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  } else {
+    wdt_reset(); /* Buy us 8 seconds time because the next IRQ might only arrive in 2 seconds */
+    set_sleep_mode(SLEEP_MODE_IDLE);
+  }
+#if defined(SLEEPSTATS)
+  sleepstart = timers_getcounts_noirq();
+  addtostat(SLEEPSTAT_AWAKE, sleepstart - lastwakeup);
+#endif
+  energy_off(ENERGY_CPU);
+  sleep_enable();
+  /* The instruction after sei() is always executed before any IRQ, so
+   * there is no race between enabling IRQs and going to sleep here. */
+  sei();
+  sleep_cpu();
+  sleep_disable();
+  cli();
+  energy_on(ENERGY_CPU);
+  if (pwrdown) {
+    sds011_setwakeup_noirq(0);
+    timers_disarmwdtwakeup_noirq();
+  }
+#if defined(SLEEPSTATS)
+  sleepend = timers_getcounts_noirq();
+  if (pwrdown) {
+    addtostat(SLEEPSTAT_PWRDOWN, sleepend - sleepstart);
+    statnumsleeps[SLEEPSTAT_PWRDOWN]++;
+  } else {
+    addtostat(SLEEPSTAT_IDLE, sleepend - sleepstart);
+    statnumsleeps[SLEEPSTAT_IDLE]++;
+  }
+  lastwakeup = sleepend;
+#endif
+  sei();
+}
@@ -0,0 +1,34 @@
+/* $Id: lowpower.h $
+ * Functions for sending the MCU to sleep as deeply as currently possible.
+ */
+
+#ifndef _LOWPOWER_H_
+#define _LOWPOWER_H_
+
+/* Go to sleep until the next IRQ arrives or the next scheduled job is due.
+ * This picks SLEEP_MODE_PWR_DOWN if nothing currently needs a running clock,
+ * else SLEEP_MODE_IDLE. Returns right away if a job is already due.
+ * Must be called with interrupts enabled, and will return with interrupts
+ * enabled. */
+void lowpower_sleep(void);
+
+#if defined(SLEEPSTATS)
+/* Indices into the statistics */
+#define SLEEPSTAT_AWAKE   0
+#define SLEEPSTAT_IDLE    1
+#define SLEEPSTAT_PWRDOWN 2
+
+struct sleepstats {
+  uint32_t awakesecs;
+  uint32_t idlesecs;
+  uint32_t pwrdownsecs;
+  uint32_t numidle;
+  uint32_t numpwrdown;
+};
+
+/* Fetch how much time we spent awake and in the sleep modes since boot.
+ * Call with interrupts disabled. */
+void lowpower_getstats_noirq(struct sleepstats * s);
+#endif /* SLEEPSTATS */
+
+#endif /* _LOWPOWER_H_ */
@@ -4,6 +4,7 @@
 
 #include <avr/io.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <util/delay.h>
 #include "lps25hb.h"
 #include "twi.h"
@@ -24,43 +25,41 @@
 #define LPS25HB_TEMP_OUT_H     0x2c
 #define LPS25HB_STATUS_REG     0x27
 
+/* Write one register */
+static void writereg(uint8_t reg, uint8_t val)
+{
+  uint8_t buf[2] = { reg, val };
+  struct twitransaction t = { LPS25HB_I2C_ADDR, buf, sizeof(buf), NULL, 0, NULL };
+  twi_run(&t);
+}
+
 void lps25hb_init(void)
 {
   /* Turn on. */
-  twi_open(LPS25HB_I2C_ADDR | I2C_WRITE);
-  twi_write(LPS25HB_CTRL_REG1);
-  twi_write(0x80);
-  twi_close();
+  writereg(LPS25HB_CTRL_REG1, 0x80);
   /* Set resolution for pressure to maximum, for temperature to minimum. */
-  twi_open(LPS25HB_I2C_ADDR | I2C_WRITE);
-  twi_write(LPS25HB_RES_CONF);
-  twi_write(0x03);
-  twi_close();
+  writereg(LPS25HB_RES_CONF, 0x03);
 }
 
 void lps25hb_startmeas(void)
 {
-  twi_open(LPS25HB_I2C_ADDR | I2C_WRITE);
-  twi_write(LPS25HB_CTRL_REG2);
   /* start single shot single shot */
-  twi_write(0x01);
-  twi_close();
+  writereg(LPS25HB_CTRL_REG2, 0x01);
 }
 
 void lps25hb_read(struct lps25hbdata * d)
 {
-  uint8_t tmp;
-  d->valid = 0;
-  twi_open(LPS25HB_I2C_ADDR | I2C_WRITE);
-  twi_write(LPS25HB_STATUS_REG | I2C_AUTOINCREGADDR);
-  twi_close();
-  twi_open(LPS25HB_I2C_ADDR | I2C_READ);
-  tmp = twi_read(1);
-  if (tmp & 0x02) { d->valid = 1; }
+  static const uint8_t reg = LPS25HB_STATUS_REG | I2C_AUTOINCREGADDR;
   /* Next register after LPS25HB_STATUS_REG (0x27) ist LPS25HB_PRESS_OUT_XL (0x28),
    * how convenient */
-  d->pressure[0] = twi_read(1);
-  d->pressure[1] = twi_read(1);
-  d->pressure[2] = twi_read(0);
-  twi_close();
+  uint8_t buf[4];
+  struct twitransaction t = { LPS25HB_I2C_ADDR, &reg, 1, buf, sizeof(buf), NULL };
+  d->valid = 0;
+  if (twi_run(&t) != TWI_OK) {
+    return;
+  }
+  if (buf[0] & 0x02) { d->valid = 1; }
+  d->pressure[0] = buf[1];
+  d->pressure[1] = buf[2];
+  d->pressure[2] = buf[3];
 }
@@ -34,6 +34,10 @@
 #define  __INCLUDE_FROM_USB_DRIVER
 #include "../USBInterrupt.h"
 
+/* foxstaub2018: interrupt latency instrumentation, see irqstats.h. This is
+ * found through -I./lufa. */
+#include "../irqstats.h"
+
 void USB_INT_DisableAllInterrupts(void)
 {
 	#if defined(USB_SERIES_6_AVR) || defined(USB_SERIES_7_AVR)
@@ -76,6 +80,8 @@ void USB_INT_ClearAllInterrupts(void)
 
 ISR(USB_GEN_vect, ISR_BLOCK)
 {
+	IRQSTATS_ISRSTART();
+
 	#if defined(USB_CAN_BE_DEVICE)
 	#if !defined(NO_SOF_EVENTS)
 	if (USB_INT_HasOccurred(USB_INT_SOFI) && USB_INT_IsEnabled(USB_INT_SOFI))
@@ -255,11 +261,14 @@ ISR(USB_GEN_vect, ISR_BLOCK)
 		EVENT_USB_UIDChange();
 	}
 	#endif
+
+	IRQSTATS_ISREND(IRQSTAT_USB);
 }
 
 #if defined(INTERRUPT_CONTROL_ENDPOINT) && defined(USB_CAN_BE_DEVICE)
 ISR(USB_COM_vect, ISR_BLOCK)
 {
+	IRQSTATS_ISRSTART();
 	uint8_t PrevSelectedEndpoint = Endpoint_GetCurrentEndpoint();
 
 	Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
@@ -272,6 +281,8 @@ ISR(USB_COM_vect, ISR_BLOCK)
 	Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
 	USB_INT_Enable(USB_INT_RXSTPI);
 	Endpoint_SelectEndpoint(PrevSelectedEndpoint);
+
+	IRQSTATS_ISREND(IRQSTAT_USB);
 }
 #endif
 
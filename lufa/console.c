@@ -39,6 +39,7 @@
 
 
 #include <avr/io.h>
+#include <avr/eeprom.h>
 #include <avr/wdt.h>
 #include <avr/power.h>
 #include <avr/interrupt.h>
@@ -47,12 +48,35 @@
 #include "console.h"
 #include "Descriptors.h"
 #include <LUFA/Drivers/USB/USB.h>
+#include "../eeprom.h"
+#include "../energy.h"
+#include "../irqstats.h"
+#include "../lowpower.h"
+#include "../powerpolicy.h"
+#if defined(ACKEDUPLINK)
+#include "../radiolink.h"
+#endif /* ACKEDUPLINK */
 #include "../rfm69.h"
+#include "../sds011.h"
+#if defined(TDMA)
+#include "../tdma.h"
+#endif /* TDMA */
+#include "../timers.h"
+#include "../twi.h"
 
 
 #define INPUTBUFSIZE 30
 static uint8_t inputbuf[INPUTBUFSIZE];
 static uint8_t inputpos = 0;
+/* Bytes received from the host, waiting for console_work() to process
+ * them with interrupts enabled. */
+#define INQUEUESIZE 64
+static uint8_t inqueue[INQUEUESIZE];
+static uint8_t inqhead = 0;
+static uint8_t inqtail = 0;
+/* Set on USB disconnect (from the USB interrupt), the half typed command
+ * line is thrown away in console_work(). */
+static volatile uint8_t discardinput = 0;
 #define OUTPUTBUFSIZE 800
 static uint8_t outputbuf[OUTPUTBUFSIZE];
 static uint16_t outputhead = 0; /* WARNING cannot be modified atomically */
@@ -70,11 +94,20 @@ static const uint8_t PROMPT[] PROGMEM = "\r\n# ";
 
 /* external variables */
 /* these are defined in main.c and contain our last measured data for output
- * in the status command.
- * Note: Since we execute from interrupt context, we might occasionally
- * get corrupted values in the uint16_t and uint32_ts.
- */
+ * in the status command. They are only changed by the jobs in the main
+ * loop, just like we run from there, so reading them is safe. */
 extern uint32_t pktssent;
+#if defined(SENDONCHANGE)
+extern uint32_t pktsskipped;
+#endif /* SENDONCHANGE */
+#if defined(LISTENBEFORETALK)
+extern uint32_t pktsdeferred;
+extern uint32_t pktsforced;
+#endif /* LISTENBEFORETALK */
+#if defined(DOWNLINKCONFIG)
+extern struct nodesettings settings;
+#endif /* DOWNLINKCONFIG */
+extern uint8_t radioprofile;
 extern uint32_t pressure;
 extern int32_t temperature;
 extern uint16_t humidity;
@@ -107,8 +140,9 @@ void EVENT_USB_Device_Connect(void)
  */
 void EVENT_USB_Device_Disconnect(void)
 {
-  /* Throw away all our buffers. */
-  inputpos = 0;
+  /* Throw away all our buffers. The input line is being worked on with
+   * interrupts enabled, so console_work() does that part. */
+  discardinput = 1;
   outputhead = 0;
   outputtail = 0;
 }
@@ -179,9 +213,12 @@ void EVENT_USB_Device_ControlRequest(void)
 #if defined __GNUC__
 static void appendchar(uint8_t what) __attribute__((noinline));
 #endif /* __GNUC__ */
-/* This can only be called safely with interrupts disabled - remember that! */
+/* This is safe to call from anywhere, including interrupt handlers: The
+ * output buffer is only ever touched with interrupts disabled. */
 static void appendchar(uint8_t what) {
   uint16_t newpos;
+  uint8_t sreg = SREG;
+  cli();
   newpos = (outputtail + 1);
   if (newpos >= OUTPUTBUFSIZE) {
     newpos = 0;
@@ -190,10 +227,12 @@ static void appendchar(uint8_t what) {
     outputbuf[outputtail] = what;
     outputtail = newpos;
   }
+  SREG = sreg;
 }
 
 /* We do all query processing here.
- * This must be called with IRQs disabled.
+ * This runs with IRQs enabled, so anything that needs them disabled (the
+ * _noirq getters) has to do that itself.
  */
 static void console_inputchar(uint8_t inpb) {
   if (escstatus == 1) {
@@ -272,6 +311,16 @@ static void console_inputchar(uint8_t inpb) {
             console_printpgm_noirq_P(PSTR("\r\n motd             repeat welcome message"));
             console_printpgm_noirq_P(PSTR("\r\n showpins [x]     shows the avrs inputpins"));
             console_printpgm_noirq_P(PSTR("\r\n status           show status / counters"));
+            console_printpgm_noirq_P(PSTR("\r\n energy           show on-times and estimated consumption"));
+            console_printpgm_noirq_P(PSTR("\r\n sdsstats         show stats of the last SDS011 measurement"));
+            console_printpgm_noirq_P(PSTR("\r\n sdscmds          show SDS011 state and command counters"));
+            console_printpgm_noirq_P(PSTR("\r\n twistats         show TWI transaction counters per device"));
+#if defined(SLEEPSTATS)
+            console_printpgm_noirq_P(PSTR("\r\n sleepstats       show time spent in the sleep modes"));
+#endif /* SLEEPSTATS */
+#if defined(IRQLATENCY)
+            console_printpgm_noirq_P(PSTR("\r\n irqstats [reset] show interrupt handler times and latency"));
+#endif /* IRQLATENCY */
           } else if (strcmp_P(inputbuf, PSTR("motd")) == 0) {
             console_printpgm_noirq_P(WELCOMEMSG);
           } else if (strncmp_P(inputbuf, PSTR("showpins"), 8) == 0) {
@@ -334,12 +383,73 @@ static void console_inputchar(uint8_t inpb) {
               }
             }
           } else if (strcmp_P(inputbuf, PSTR("status")) == 0) {
-            uint8_t tmpbuf[20];
+            uint8_t tmpbuf[60];
+            uint32_t now = timers_getms();
             console_printpgm_noirq_P(PSTR("Status / last measured values:\r\n"));
+            console_printpgm_noirq_P(PSTR("Uptime: "));
+            sprintf_P(tmpbuf, PSTR("%lu.%03u s"), now / 1000, (uint16_t)(now % 1000));
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR("\r\n"));
+            console_printpgm_noirq_P(PSTR("Radio profile: "));
+            console_printdec_noirq(radioprofile);
+            console_printpgm_noirq_P(PSTR("\r\n"));
             console_printpgm_noirq_P(PSTR("Packets sent: "));
             sprintf_P(tmpbuf, PSTR("%10lu"), pktssent);
             console_printtext_noirq(tmpbuf);
             console_printpgm_noirq_P(PSTR("\r\n"));
+#if defined(SENDONCHANGE)
+            console_printpgm_noirq_P(PSTR("Packets skipped (unchanged): "));
+            sprintf_P(tmpbuf, PSTR("%10lu"), pktsskipped);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR("\r\n"));
+#endif /* SENDONCHANGE */
+#if defined(LISTENBEFORETALK)
+            console_printpgm_noirq_P(PSTR("Sends deferred (channel busy): "));
+            sprintf_P(tmpbuf, PSTR("%10lu"), pktsdeferred);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR("\r\nSent despite busy channel:    "));
+            sprintf_P(tmpbuf, PSTR("%10lu"), pktsforced);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR("\r\n"));
+#endif /* LISTENBEFORETALK */
+#if defined(DOWNLINKCONFIG)
+            sprintf_P(tmpbuf, PSTR("Config #%u: TX every %u, SDS011 %u of %u ticks\r\n"),
+                      settings.seq, settings.txinterval,
+                      settings.sdscycleontime, settings.sdscyclelength);
+            console_printtext_noirq(tmpbuf);
+#if !defined(ACKEDUPLINK)
+            sprintf_P(tmpbuf, PSTR("TX power: %d dBm\r\n"), settings.txdbm);
+            console_printtext_noirq(tmpbuf);
+#endif /* !ACKEDUPLINK */
+#endif /* DOWNLINKCONFIG */
+#if defined(ACKEDUPLINK)
+            struct radiolinkstats rs;
+            cli();
+            radiolink_getstats_noirq(&rs);
+            sei();
+            sprintf_P(tmpbuf, PSTR("TX power: %d dBm, RSSI at gateway: -%u.%u dBm\r\n"),
+                      rs.txdbm, rs.gwrssi / 2, (rs.gwrssi & 1) ? 5 : 0);
+            console_printtext_noirq(tmpbuf);
+            sprintf_P(tmpbuf, PSTR("Frames acked: %lu, resent: %lu, lost: %lu\r\n"),
+                      rs.acked, rs.retries, rs.lost);
+            console_printtext_noirq(tmpbuf);
+#endif /* ACKEDUPLINK */
+#if defined(TDMA)
+            struct tdmastats ts;
+            cli();
+            tdma_getstats_noirq(&ts);
+            sei();
+            if (ts.synced) {
+              sprintf_P(tmpbuf, PSTR("TDMA: synced, slot %u of %u (%u ms), drift %d ppm\r\n"),
+                        ts.slot, ts.numslots, ts.slotms, ts.driftppm);
+            } else {
+              sprintf_P(tmpbuf, PSTR("TDMA: free-running\r\n"));
+            }
+            console_printtext_noirq(tmpbuf);
+            sprintf_P(tmpbuf, PSTR("Beacons: %lu received, %lu missed, sync lost %lu times\r\n"),
+                      ts.beaconsrx, ts.beaconsmissed, ts.syncslost);
+            console_printtext_noirq(tmpbuf);
+#endif /* TDMA */
             console_printpgm_noirq_P(PSTR("Pressure: "));
             sprintf_P(tmpbuf, PSTR("%.3f"), (float)pressure / 25600.0);
             console_printtext_noirq(tmpbuf);
@@ -375,7 +485,180 @@ static void console_inputchar(uint8_t inpb) {
             console_printpgm_noirq_P(PSTR("PM10:  "));
             sprintf_P(tmpbuf, PSTR("%5.1f"), (float)particulatematter10u / 10.0);
             console_printtext_noirq(tmpbuf);
-            console_printpgm_noirq_P(PSTR(" ug/m^3"));
+            console_printpgm_noirq_P(PSTR(" ug/m^3\r\n"));
+            console_printpgm_noirq_P(PSTR("Power level: "));
+            console_printdec_noirq(powerpolicy_getlevel());
+            console_printpgm_noirq_P(PSTR(" (0 = normal, 3 = critical, no PM measurements)\r\n"));
+            console_printpgm_noirq_P(PSTR("Last PM data received: "));
+            cli();
+            uint32_t lastpmts = sds011_getlastpmts_noirq();
+            sei();
+            sprintf_P(tmpbuf, PSTR("%lu ms ago"), now - lastpmts);
+            console_printtext_noirq(tmpbuf);
+          } else if (strcmp_P(inputbuf, PSTR("energy")) == 0) {
+            uint8_t tmpbuf[40];
+            uint32_t secs;
+            uint16_t ms;
+            float totalmah = 0.0;
+            uint32_t now = timers_getms();
+            static const uint32_t uas[ENERGY_NUMCOUNTERS] PROGMEM = {
+              ENERGY_UA_SDS011, ENERGY_UA_RADIOSTBY, ENERGY_UA_RADIOTX,
+              ENERGY_UA_ADC, ENERGY_UA_TWI, ENERGY_UA_CPU, ENERGY_UA_RADIORX };
+            static const char names[ENERGY_NUMCOUNTERS][11] PROGMEM = {
+              "SDS011", "Radio stby", "Radio TX", "ADC", "TWI", "CPU awake", "Radio RX" };
+            console_printpgm_noirq_P(PSTR("On-time since boot / estimated consumption:"));
+            for (uint8_t i = 0; i < ENERGY_NUMCOUNTERS; i++) {
+              energy_get(i, &secs, &ms);
+              float mah = (((float)secs + ((float)ms / 1000.0))
+                           * (float)pgm_read_dword(&uas[i])) / 3600000.0;
+              totalmah += mah;
+              console_printpgm_noirq_P(PSTR("\r\n"));
+              console_printpgm_noirq_P(names[i]);
+              sprintf_P(tmpbuf, PSTR(": %lu.%03u s, %.3f mAh"), secs, ms, mah);
+              console_printtext_noirq(tmpbuf);
+            }
+            console_printpgm_noirq_P(PSTR("\r\nTotal: "));
+            sprintf_P(tmpbuf, PSTR("%.3f mAh, %.1f mAh/day"), totalmah,
+                      (now > 0) ? ((totalmah * 86400000.0) / (float)now) : 0.0);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR(" (without sleep currents)"));
+          } else if (strcmp_P(inputbuf, PSTR("twistats")) == 0) {
+            uint8_t tmpbuf[60];
+            struct twistats ts;
+            console_printpgm_noirq_P(PSTR("Addr         OK  NACK Timeout BusErr"));
+            for (uint8_t i = 0; i < TWI_MAXDEVS; i++) {
+              cli();
+              twi_getstats_noirq(i, &ts);
+              sei();
+              if (ts.addr == 0) { break; }
+              sprintf_P(tmpbuf, PSTR("\r\n0x%02x %10lu %5u %7u %6u"),
+                        ts.addr >> 1, ts.ok, ts.nack, ts.timeout, ts.buserror);
+              console_printtext_noirq(tmpbuf);
+            }
+          } else if (strcmp_P(inputbuf, PSTR("sdsstats")) == 0) {
+            uint8_t tmpbuf[60];
+            struct sds011stats st;
+            cli();
+            sds011_getstats_noirq(&st);
+            sei();
+            sprintf_P(tmpbuf, PSTR("Last SDS011 measurement: %u readings"), st.num);
+            console_printtext_noirq(tmpbuf);
+            sprintf_P(tmpbuf, PSTR("\r\nOn for %lu.%03u s, "),
+                      st.ontimems / 1000, (uint16_t)(st.ontimems % 1000));
+            console_printtext_noirq(tmpbuf);
+            if (st.converged) {
+              console_printpgm_noirq_P(PSTR("stopped early (readings stable)"));
+            } else {
+              console_printpgm_noirq_P(PSTR("ran for the maximum time"));
+            }
+            if (st.num > 0) {
+              console_printpgm_noirq_P(PSTR("\r\n       median   mean    min    max (ug/m^3)"));
+              sprintf_P(tmpbuf, PSTR("\r\nPM2.5 %4u.%u %4u.%u %4u.%u %4u.%u"),
+                        st.pm2_5.median / 10, st.pm2_5.median % 10,
+                        st.pm2_5.mean / 10, st.pm2_5.mean % 10,
+                        st.pm2_5.min / 10, st.pm2_5.min % 10,
+                        st.pm2_5.max / 10, st.pm2_5.max % 10);
+              console_printtext_noirq(tmpbuf);
+              sprintf_P(tmpbuf, PSTR("\r\nPM10  %4u.%u %4u.%u %4u.%u %4u.%u"),
+                        st.pm10.median / 10, st.pm10.median % 10,
+                        st.pm10.mean / 10, st.pm10.mean % 10,
+                        st.pm10.min / 10, st.pm10.min % 10,
+                        st.pm10.max / 10, st.pm10.max % 10);
+              console_printtext_noirq(tmpbuf);
+            }
+          } else if (strcmp_P(inputbuf, PSTR("sdscmds")) == 0) {
+            uint8_t tmpbuf[60];
+            struct sds011cmdstats cs;
+            cli();
+            sds011_getcmdstats_noirq(&cs);
+            sei();
+            console_printpgm_noirq_P(PSTR("SDS011 state: "));
+            if (cs.working == SDS011_UNKNOWN) {
+              console_printpgm_noirq_P(PSTR("unknown"));
+            } else {
+              console_printpgm_noirq_P((cs.working) ? PSTR("working") : PSTR("sleeping"));
+            }
+            console_printpgm_noirq_P(PSTR(", reporting mode: "));
+            if (cs.reportmode == SDS011_UNKNOWN) {
+              console_printpgm_noirq_P(PSTR("unknown"));
+            } else {
+              console_printpgm_noirq_P((cs.reportmode) ? PSTR("query") : PSTR("active"));
+            }
+            if (cs.workperiod != SDS011_UNKNOWN) {
+              sprintf_P(tmpbuf, PSTR(", working period: %u min"), cs.workperiod);
+              console_printtext_noirq(tmpbuf);
+            }
+            sprintf_P(tmpbuf, PSTR("\r\nCommands sent: %u, confirmed: %u"),
+                      cs.sent, cs.confirmed);
+            console_printtext_noirq(tmpbuf);
+            sprintf_P(tmpbuf, PSTR("\r\nRetries: %u, failed: %u"),
+                      cs.retries, cs.failed);
+            console_printtext_noirq(tmpbuf);
+            sprintf_P(tmpbuf, PSTR("\r\nMismatches: %u replies, %u readings while sleeping"),
+                      cs.replymismatches, cs.statemismatches);
+            console_printtext_noirq(tmpbuf);
+#if defined(SDS011WORKINGPERIOD)
+            sprintf_P(tmpbuf, PSTR("\r\nReadings missed: %u, resyncs: %u"),
+                      cs.missedreadings, cs.resyncs);
+            console_printtext_noirq(tmpbuf);
+#endif /* SDS011WORKINGPERIOD */
+#if defined(SLEEPSTATS)
+          } else if (strcmp_P(inputbuf, PSTR("sleepstats")) == 0) {
+            uint8_t tmpbuf[20];
+            struct sleepstats ss;
+            cli();
+            lowpower_getstats_noirq(&ss);
+            sei();
+            console_printpgm_noirq_P(PSTR("Time spent in sleep modes since boot:\r\n"));
+            console_printpgm_noirq_P(PSTR("Awake:      "));
+            sprintf_P(tmpbuf, PSTR("%10lu"), ss.awakesecs);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR(" s\r\nIdle:       "));
+            sprintf_P(tmpbuf, PSTR("%10lu"), ss.idlesecs);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR(" s in "));
+            sprintf_P(tmpbuf, PSTR("%lu"), ss.numidle);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR(" sleeps\r\nPower-down: "));
+            sprintf_P(tmpbuf, PSTR("%10lu"), ss.pwrdownsecs);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR(" s in "));
+            sprintf_P(tmpbuf, PSTR("%lu"), ss.numpwrdown);
+            console_printtext_noirq(tmpbuf);
+            console_printpgm_noirq_P(PSTR(" sleeps"));
+#endif /* SLEEPSTATS */
+#if defined(IRQLATENCY)
+          } else if (strncmp_P(inputbuf, PSTR("irqstats"), 8) == 0) {
+            uint8_t tmpbuf[40];
+            struct irqstat is;
+            static const char names[IRQSTAT_NUM][11] PROGMEM = {
+              "USART1 RX", "USART1 TX", "TIMER1 OVF", "USB", "Latency" };
+            if (strcmp_P(&inputbuf[8], PSTR(" reset")) == 0) {
+              cli();
+              irqstats_reset_noirq();
+              sei();
+              console_printpgm_noirq_P(PSTR("Interrupt statistics reset."));
+            } else {
+              console_printpgm_noirq_P(PSTR("Times in us, resolution 32 us. Latency is sampled every 8 ms.\r\n"));
+              console_printpgm_noirq_P(PSTR("             max      count    <32    <64   <128   <256   <512    <1m    <2m   more"));
+              for (uint8_t i = 0; i < IRQSTAT_NUM; i++) {
+                cli();
+                irqstats_get_noirq(i, &is);
+                sei();
+                console_printpgm_noirq_P(PSTR("\r\n"));
+                console_printpgm_noirq_P(names[i]);
+                for (uint8_t j = strlen_P(names[i]); j < 10; j++) {
+                  appendchar(' ');
+                }
+                sprintf_P(tmpbuf, PSTR(" %6lu %10lu"), (uint32_t)is.max * 32, is.num);
+                console_printtext_noirq(tmpbuf);
+                for (uint8_t b = 0; b < IRQSTAT_NUMBUCKETS; b++) {
+                  sprintf_P(tmpbuf, PSTR(" %6u"), is.hist[b]);
+                  console_printtext_noirq(tmpbuf);
+                }
+              }
+            }
+#endif /* IRQLATENCY */
           } else if (strncmp_P(inputbuf, PSTR("rfm69reg"), 8) == 0) {
             uint8_t star = 0x01;
             uint8_t endr = 0x4f;  /* Show all relevant ones by default */
@@ -418,8 +701,9 @@ static void console_inputchar(uint8_t inpb) {
   };
 }
 
-/* Function to manage CDC data transmission and reception to and from the host. */
-/* call with interrupts disabled! */
+/* Function to manage CDC data transmission and reception to and from the host.
+ * Received bytes only go into inqueue here, they are processed later.
+ * Call with interrupts disabled! */
 void CDC_Task(void)
 {
   /* Device must be connected and configured for the task to run */
@@ -434,14 +718,20 @@ void CDC_Task(void)
     uint8_t inp[2];
     uint8_t i;
     uint8_t bytestoread = Endpoint_BytesInEndpoint();
-    for (i = 0; i < bytestoread; i++) {
-      errorcode = Endpoint_Read_Stream_LE(inp, 1, NULL);
-      if (errorcode != ENDPOINT_RWSTREAM_NoError) {
-        break;
+    uint8_t space = (uint8_t)(inqhead - inqtail - 1) % INQUEUESIZE;
+    /* If it does not all fit, leave it in the endpoint until next time.
+     * The host has to wait until we cleared it. */
+    if (bytestoread <= space) {
+      for (i = 0; i < bytestoread; i++) {
+        errorcode = Endpoint_Read_Stream_LE(inp, 1, NULL);
+        if (errorcode != ENDPOINT_RWSTREAM_NoError) {
+          break;
+        }
+        inqueue[inqtail] = inp[0];
+        inqtail = (inqtail + 1) % INQUEUESIZE;
       }
-      console_inputchar(inp[0]);
+      Endpoint_ClearOUT();
     }
-    Endpoint_ClearOUT();
   }
 
   /* Select the Serial Tx Endpoint */
@@ -470,7 +760,6 @@ void console_printchar_noirq(uint8_t what) {
   appendchar(what);
 }
 
-/* This can only be called safely with interrupts disabled - remember that! */
 void console_printhex8_noirq(uint8_t what) {
   uint8_t buf;
   uint8_t i;
@@ -486,7 +775,6 @@ void console_printhex8_noirq(uint8_t what) {
   }
 }
 
-/* This can only be called safely with interrupts disabled - remember that! */
 void console_printdec_noirq(uint8_t what) {
   uint8_t buf;
   buf = what / 100;
@@ -498,7 +786,6 @@ void console_printdec_noirq(uint8_t what) {
   appendchar(buf + '0');
 }
 
-/* This can only be called safely with interrupts disabled - remember that! */
 /* This is the same as printec, but only prints 2 digits (e.g. for times/dates) */
 void console_printdec2_noirq(uint8_t what) {
   if (what > 99) { what = 99; }
@@ -506,7 +793,6 @@ void console_printdec2_noirq(uint8_t what) {
   appendchar((what % 10) + '0');
 }
 
-/* This can only be called safely with interrupts disabled - remember that! */
 void console_printbin8_noirq(uint8_t what) {
   uint8_t i;
   for (i = 0; i < 8; i++) {
@@ -519,7 +805,6 @@ void console_printbin8_noirq(uint8_t what) {
   }
 }
 
-/* This can only be called safely with interrupts disabled - remember that! */
 void console_printtext_noirq(const uint8_t * what) {
   while (*what) {
     appendchar(*what);
@@ -527,7 +812,6 @@ void console_printtext_noirq(const uint8_t * what) {
   }
 }
 
-/* This can only be called safely with interrupts disabled - remember that! */
 void console_printpgm_noirq_P(PGM_P what) {
   uint8_t t;
   while ((t = pgm_read_byte(what++))) {
@@ -536,35 +820,41 @@ void console_printpgm_noirq_P(PGM_P what) {
 }
 
 /* These are wrappers for our internal functions, disabling IRQs before
- * calling them. */
+ * calling them, and restoring the previous state afterwards, so they can
+ * also be used before interrupts are first enabled. */
 void console_printchar(uint8_t what) {
+  uint8_t sreg = SREG;
   cli();
   console_printchar_noirq(what);
-  sei();
+  SREG = sreg;
 }
 
 void console_printtext(const uint8_t * what) {
+  uint8_t sreg = SREG;
   cli();
   console_printtext_noirq(what);
-  sei();
+  SREG = sreg;
 }
 
 void console_printpgm_P(PGM_P what) {
+  uint8_t sreg = SREG;
   cli();
   console_printpgm_noirq_P(what);
-  sei();
+  SREG = sreg;
 }
 
 void console_printhex8(uint8_t what) {
+  uint8_t sreg = SREG;
   cli();
   console_printhex8_noirq(what);
-  sei();
+  SREG = sreg;
 }
 
 void console_printdec(uint8_t what) {
+  uint8_t sreg = SREG;
   cli();
   console_printdec_noirq(what);
-  sei();
+  SREG = sreg;
 }
 
 /* Initialize ourselves. Must be called with interrupts still disabled! */
@@ -577,25 +867,48 @@ void console_init(void)
 
 void console_work(void)
 {
+  /* Only the USB endpoint handling needs interrupts disabled. Commands
+   * can take a while, so they run with interrupts enabled, or we would
+   * lose bytes from the SDS011 and delay the timer. */
   cli();
   CDC_Task();
   sei();
+  if (discardinput) {
+    discardinput = 0;
+    inputpos = 0;
+    escstatus = 0;
+    inqhead = inqtail;
+  }
+  while (inqhead != inqtail) {
+    uint8_t c = inqueue[inqhead];
+    inqhead = (inqhead + 1) % INQUEUESIZE;
+    console_inputchar(c);
+  }
 }
 
 uint8_t console_isusbconfigured(void) {
   return (USB_DeviceState == DEVICE_STATE_Configured);
 }
 
+uint8_t console_isusbsuspended(void) {
+  /* When we're just powered from a USB charger, LUFA will see the bus
+   * suspended a few ms after VBUS appears. While a host is enumerating
+   * us we must not stop the clock though. */
+  return ((USB_DeviceState == DEVICE_STATE_Unattached)
+       || (USB_DeviceState == DEVICE_STATE_Suspended));
+}
+
 #else /* SERIALCONSOLE */
 
 void console_init(void) { }
 void console_work(void) { }
 uint8_t console_isusbconfigured(void) { return 0; }
+uint8_t console_isusbsuspended(void) { return 1; }
 void console_printchar_noirq(uint8_t c) { }
-void console_printchar(uint8_t c) { sei(); }
-void console_printtext(const uint8_t * what) { sei(); }
-void console_printpgm_P(PGM_P what) { sei(); }
-void console_printhex8(uint8_t what) { sei(); }
-void console_printdec(uint8_t what) { sei(); }
+void console_printchar(uint8_t c) { }
+void console_printtext(const uint8_t * what) { }
+void console_printpgm_P(PGM_P what) { }
+void console_printhex8(uint8_t what) { }
+void console_printdec(uint8_t what) { }
 
 #endif /* SERIALCONSOLE */
@@ -50,9 +50,12 @@ void console_init(void);
 void console_work(void);
 /* Check if we're connected to a PC. */
 uint8_t console_isusbconfigured(void);
+/* Check if USB is idle (unplugged or suspended), so the clock may be stopped. */
+uint8_t console_isusbsuspended(void);
 
-/* These need to be called with IRQs disabled! They are usually NOT what
- * you want. */
+/* These do not touch the interrupt flag, so they can be used with IRQs
+ * disabled and from interrupt handlers. The output buffer protects
+ * itself. */
 void console_printchar_noirq(uint8_t c);
 void console_printtext_noirq(const uint8_t * what);
 void console_printpgm_noirq_P(PGM_P what);
@@ -60,7 +63,8 @@ void console_printhex8_noirq(uint8_t what);
 void console_printdec_noirq(uint8_t what);
 void console_printbin8_noirq(uint8_t what);
 
-/* These can be called with interrupts enabled (and will reenable them!) */
+/* These can be called with interrupts enabled or disabled, they leave the
+ * interrupt flag as they found it. */
 void console_printchar(uint8_t c);
 void console_printtext(const uint8_t * what);
 void console_printpgm_P(PGM_P what);
@@ -14,17 +14,36 @@
 #include <util/delay.h>
 
 #include "adc.h"
+#include "crc8.h"
+#if defined(DOWNLINKCONFIG)
+#include "downlink.h"
+#endif /* DOWNLINKCONFIG */
 #include "eeprom.h"
+#include "energy.h"
+#include "frame.h"
+#include "irqstats.h"
+#include "lowpower.h"
 #include "lps25hb.h"
 #include "lufa/console.h"
+#include "powerpolicy.h"
+#include "radiolink.h"
 #include "rfm69.h"
+#include "rnd.h"
 #include "sds011.h"
 #include "sht3x.h"
+#if defined(TDMA)
+#include "tdma.h"
+#endif /* TDMA */
 #include "timers.h"
+#include "twi.h"
 
 /* The values last measured */
 /* How often did we send a packet? */
 uint32_t pktssent = 0;
+#if defined(SENDONCHANGE)
+/* How often did we not send one because nothing changed? */
+uint32_t pktsskipped = 0;
+#endif /* SENDONCHANGE */
 /* Pressure, in (Pascal * 256) */
 uint32_t pressure = 0;
 /* Temperature, in (degC * 100) */
@@ -41,14 +60,179 @@ uint8_t batvolt = 0;
 /* This is just a fallback value, in case we cannot read this from EEPROM
  * on Boot */
 uint8_t sensorid = 3; // 0 - 255 / 0xff
+#if !defined(RADIOPROFILE)
+#define RADIOPROFILE 0 /* Compatible with the Jeelink */
+#endif
+uint8_t radioprofile = RADIOPROFILE;
 
 /* The frame we're preparing to send. */
 static uint8_t frametosend[17];
+/* The frame transmit() sends, its length, and what to print on the console */
+static uint8_t * txbuf;
+static uint8_t txlen;
+static PGM_P txtag;
 
-/* Length of one SDS011 measurement cycle, in ticks. */
+#if defined(LISTENBEFORETALK)
+/* Carrier sense threshold: The channel counts as busy if the RSSI is at
+ * or above -90 dBm (raw value -2 * dBm, see rfm69_channelfree()) */
+#define LBTRSSITHRESH 180
+/* Backoff after finding the channel busy: LBTMINBACKOFFMS plus a random
+ * time below LBTBACKOFFWINMS, which doubles with each retry */
+#define LBTMINBACKOFFMS 10
+#define LBTBACKOFFWINMS 64
+/* After this many retries, we send anyways */
+#define LBTMAXDEFERS 5
+static uint8_t lbtdefers = 0;
+/* How often did we have to wait for the channel, and how often did we
+ * give up waiting? */
+uint32_t pktsdeferred = 0;
+uint32_t pktsforced = 0;
+#endif /* LISTENBEFORETALK */
+#if defined(ACKEDUPLINK)
+/* Wait before sending again after a missing ACK: ACKRETRYMINMS plus a
+ * random time below ACKRETRYWINMS, so two sensors whose frames collided
+ * do not collide again. */
+#define ACKRETRYMINMS 20
+#define ACKRETRYWINMS 100
+static uint8_t txretries = 0;
+#endif /* ACKEDUPLINK */
+
+#if defined(PMSYNCEDTX)
+/* The short frame without PM values, see prepareenvframe() */
+static uint8_t envframe[13];
+/* Set when the SDS011 delivered a new result that has not been sent yet */
+static uint8_t pmfresh = 0;
+#endif /* PMSYNCEDTX */
+
+#if defined(BATCHEDFRAMES)
+/* How many readings we collect before sending them in one frame. 4 is the
+ * most that fits into the 66 byte FIFO of the RFM69. */
+#define BATCHSIZE 4
+/* The batched frame, see preparebatchframe(), and the readings waiting
+ * to go into it */
+static uint8_t batchframe[6 + (BATCHSIZE * 13) + 1];
+static uint8_t batchreadings[BATCHSIZE][12];
+static uint8_t batchnum = 0;       /* Number of readings collected */
+static uint8_t batchseq = 0;       /* Sequence number of the next reading */
+static uint16_t batchts[BATCHSIZE]; /* When they were taken (ticks) */
+#endif /* BATCHEDFRAMES */
+
+#if defined(PAYLOADV2)
+#if defined(BATCHEDFRAMES)
+#error "PAYLOADV2 and BATCHEDFRAMES cannot be used together"
+#endif
+/* Send a keyframe with every n-th packet, deltas against it in between */
+#define KEYFRAMEINTERVAL 10
+/* The v2 frame, see prepareframev2(). A delta frame is at most 18 bytes of
+ * varints, a keyframe 12 bytes. */
+static uint8_t v2frame[5 + 18 + 1];
+/* Values in the last keyframe, and its number */
+static uint32_t keypressure;
+static uint16_t keytemperature;
+static uint16_t keyhumidity;
+static uint16_t keypm2_5u;
+static uint16_t keypm10u;
+static uint8_t keybatvolt;
+static uint8_t keyseq = 0;
+static uint8_t framessincekey = KEYFRAMEINTERVAL; /* Start with a keyframe */
+#endif /* PAYLOADV2 */
+
+#if defined(ENERGYTELEMETRY)
+/* The energy telemetry frame. */
+static uint8_t energyframe[26];
+/* Send one of these with every n-th normal packet */
+#define ENERGYTELEMETRYINTERVAL 20 /* about every 10 minutes */
+#endif /* ENERGYTELEMETRY */
+
+#if defined(SENDONCHANGE)
+/* How much a value needs to change (in the raw units prepareframe() uses)
+ * before we send a new packet. */
+#define SOCDELTA_PRESSURE  819   /* 0.2 hPa */
+#define SOCDELTA_TEMP       75   /* 0.2 degC */
+#define SOCDELTA_HUM       655   /* 1 % */
+#define SOCDELTA_PM         10   /* 1 ug/m^3 */
+#define SOCDELTA_BATVOLT     2   /* 0.22 V */
+/* Send anyways if we were silent for this many transmit intervals */
+#define SOCHEARTBEAT        20   /* about 10 minutes */
+/* The values from the last packet we actually sent */
+static uint32_t lastpressure;
+static int32_t lasttemperature;
+static uint16_t lasthumidity;
+static uint16_t lastpm2_5u;
+static uint16_t lastpm10u;
+static uint8_t lastbatvolt;
+static uint8_t silentintervals = SOCHEARTBEAT; /* Forces a send on first call */
+
+static uint8_t movedpast(int32_t a, int32_t b, int32_t delta)
+{
+  return ((a - b) >= delta) || ((b - a) >= delta);
+}
+
+/* Check if any value moved far enough since the last packet we sent, or
+ * if it's time for a heartbeat. */
+static uint8_t needtosend(void)
+{
+  if (silentintervals >= SOCHEARTBEAT) { return 1; }
+  if (movedpast(pressure, lastpressure, SOCDELTA_PRESSURE)) { return 1; }
+  if (movedpast(temperature, lasttemperature, SOCDELTA_TEMP)) { return 1; }
+  if (movedpast(humidity, lasthumidity, SOCDELTA_HUM)) { return 1; }
+  if (movedpast(particulatematter2_5u, lastpm2_5u, SOCDELTA_PM)) { return 1; }
+  if (movedpast(particulatematter10u, lastpm10u, SOCDELTA_PM)) { return 1; }
+  if (movedpast(batvolt, lastbatvolt, SOCDELTA_BATVOLT)) { return 1; }
+  return 0;
+}
+
+static void rememberlastsent(void)
+{
+  silentintervals = 0;
+  lastpressure = pressure;
+  lasttemperature = temperature;
+  lasthumidity = humidity;
+  lastpm2_5u = particulatematter2_5u;
+  lastpm10u = particulatematter10u;
+  lastbatvolt = batvolt;
+}
+#endif /* SENDONCHANGE */
+
+/* Decide whether the readings we just took get sent. Without
+ * SENDONCHANGE, they always are. */
+static uint8_t shouldsend(void)
+{
+#if defined(SENDONCHANGE)
+  if (!needtosend()) {
+    silentintervals++;
+    pktsskipped++;
+    return 0;
+  }
+  rememberlastsent();
+#endif /* SENDONCHANGE */
+  return 1;
+}
+
+/* Length of one SDS011 measurement cycle, in ticks. This gets stretched
+ * by the power policy when the battery runs low. */
 #define SDS011CYCLELENGTH 72 /* 151 seconds */
-/* How long do we turn the sensor on at the beginning of the cycle? */
+/* How long do we turn the sensor on at the beginning of the cycle at most?
+ * Usually it is turned off earlier, as soon as its readings are stable. */
 #define SDS011CYCLEONTIME 15 /* 31 seconds */
+/* Average transmit interval in ticks. We randomly use one tick more or
+ * less, so sensors do not keep colliding. */
+#define TXINTERVAL 16 /* 34 seconds */
+
+#if defined(DOWNLINKCONFIG)
+/* These can be changed by the gateway, and are then loaded from the
+ * EEPROM on startup. */
+struct nodesettings settings = {
+  0, TXINTERVAL, SDS011CYCLELENGTH, SDS011CYCLEONTIME, RFM69_MAXDBM, 0
+};
+#define CFG_TXINTERVAL settings.txinterval
+#define CFG_SDS011CYCLELENGTH settings.sdscyclelength
+#define CFG_SDS011CYCLEONTIME settings.sdscycleontime
+#else /* DOWNLINKCONFIG */
+#define CFG_TXINTERVAL TXINTERVAL
+#define CFG_SDS011CYCLELENGTH SDS011CYCLELENGTH
+#define CFG_SDS011CYCLEONTIME SDS011CYCLEONTIME
+#endif /* DOWNLINKCONFIG */
 
 /* We need to disable the watchdog very early, because it stays active
  * after a reset with a timeout of only 15 ms. */
@@ -58,22 +242,15 @@ void dwdtonreset(void) {
   wdt_disable();
 }
 
-static uint8_t calculatecrc(uint8_t * data, uint8_t len)
+/* The readings, as in bytes 4 - 15 of the normal frame */
+static void putreading(struct framebuilder * f)
 {
-  uint8_t i, j;
-  uint8_t res = 0;
-  for (j = 0; j < len; j++) {
-    uint8_t val = data[j];
-    for (i = 0; i < 8; i++) {
-      uint8_t tmp = (uint8_t)((res ^ val) & 0x80);
-      res <<= 1;
-      if (0 != tmp) {
-        res ^= 0x31;
-      }
-      val <<= 1;
-    }
-  }
-  return res;
+  frame_put24(f, pressure);
+  frame_put16(f, temperature);
+  frame_put16(f, humidity);
+  frame_put16(f, particulatematter2_5u);
+  frame_put16(f, particulatematter10u);
+  frame_put8(f, batvolt);
 }
 
 /* Fill the frame to send with our collected data and a CRC.
@@ -98,28 +275,170 @@ static uint8_t calculatecrc(uint8_t * data, uint8_t len)
  * Byte 13: PM10, MSB
  * Byte 14: PM10, LSB
  * Byte 15: battery voltage
- * Byte 16: CRC
+ * Byte 16: CRC (not with HWPACKET, the radio adds a CRC16 then)
+ * Returns the length of the frame.
+ */
+static uint8_t prepareframe(void)
+{
+  struct framebuilder f;
+  frame_begin(&f, frametosend, sizeof(frametosend), 0xf5); /* FoxStaub */
+  putreading(&f);
+  return frame_finish(&f);
+}
+
+#if defined(PAYLOADV2)
+/* Payload format v2. Uses the same CustomSensor header as the normal frame.
+ *
+ * Byte  0: Startbyte (=0xCC)
+ * Byte  1: Sensor-ID (0 - 255/0xff)
+ * Byte  2: Number of data bytes that follow (CRC not counted)
+ * Byte  3: Sensortype (=0xf8 for FoxStaub v2)
+ * Byte  4: Bit 7: 1 for a keyframe, 0 for a delta frame.
+ *          Bit 0-6: Number of the keyframe (this one, or the one the
+ *          deltas are relative to), wrapping at 127.
+ * Keyframe:
+ * Byte  5-16: Same as bytes 4-15 of the normal frame
+ * Delta frame:
+ * Byte  5-  : Difference to the keyframe for pressure, temperature,
+ *             humidity, PM2.5, PM10 and battery voltage, in that order.
+ *             These are computed modulo the field width of the normal frame
+ *             (24, 16 or 8 bits), zigzag encoded and sent as varints.
+ * After that: CRC
+ * Returns the length of the frame.
+ */
+static uint8_t prepareframev2(void)
+{
+  struct framebuilder f;
+  frame_begin(&f, v2frame, sizeof(v2frame), 0xf8); /* FoxStaub v2 */
+  if (framessincekey >= KEYFRAMEINTERVAL) {
+    framessincekey = 0;
+    keyseq = (keyseq + 1) & 0x7f;
+    keypressure = pressure & 0xffffff;
+    keytemperature = temperature;
+    keyhumidity = humidity;
+    keypm2_5u = particulatematter2_5u;
+    keypm10u = particulatematter10u;
+    keybatvolt = batvolt;
+    frame_put8(&f, 0x80 | keyseq);
+    putreading(&f);
+  } else {
+    framessincekey++;
+    frame_put8(&f, keyseq);
+    /* Shifting the 24 bit difference up and back down sign extends it */
+    frame_putvarint(&f, (int32_t)((pressure - keypressure) << 8) >> 8);
+    frame_putvarint(&f, (int16_t)((uint16_t)temperature - keytemperature));
+    frame_putvarint(&f, (int16_t)(humidity - keyhumidity));
+    frame_putvarint(&f, (int16_t)(particulatematter2_5u - keypm2_5u));
+    frame_putvarint(&f, (int16_t)(particulatematter10u - keypm10u));
+    frame_putvarint(&f, (int8_t)(batvolt - keybatvolt));
+  }
+  return frame_finish(&f);
+}
+#endif /* PAYLOADV2 */
+
+#if defined(BATCHEDFRAMES)
+/* Batched frame: Collects several readings and sends them in one go, which
+ * saves the preamble, sync word and radio wakeup for all but one of them.
+ *
+ * Byte  0: Startbyte (=0xCC)
+ * Byte  1: Sensor-ID (0 - 255/0xff)
+ * Byte  2: Number of data bytes that follow (3 + 13 * number of readings)
+ * Byte  3: Sensortype (=0xf7 for FoxStaub batched)
+ * Byte  4: Sequence number of the first reading. Readings are numbered
+ *          consecutively (wrapping at 255), so the receiver can tell
+ *          exactly which ones it missed.
+ * Byte  5: Number of readings that follow (1 - 4)
+ * For each reading, oldest first, 13 bytes:
+ * Byte  0: Age of the reading when the frame was sent, in ticks of 2.1 s
+ * Byte  1-12: Same as bytes 4-15 of the normal frame
+ * After the readings: CRC
  */
-void prepareframe(void)
+static void addtobatch(void)
+{
+  struct framebuilder f;
+  batchts[batchnum] = timers_getticks();
+  frame_beginraw(&f, batchreadings[batchnum], sizeof(batchreadings[0]));
+  putreading(&f);
+  batchnum++;
+}
+
+/* Build the batched frame, and return its length */
+static uint8_t preparebatchframe(void)
 {
-  frametosend[ 0] = 0xCC;
-  frametosend[ 1] = sensorid;
-  frametosend[ 2] = 13; /* 13 bytes of data follow (CRC not counted) */
-  frametosend[ 3] = 0xf5; /* Sensor type: FoxStaub */
-  frametosend[ 4] = (pressure >> 16) & 0xff;
-  frametosend[ 5] = (pressure >>  8) & 0xff;
-  frametosend[ 6] = (pressure >>  0) & 0xff;
-  frametosend[ 7] = (temperature >> 8) & 0xff;
-  frametosend[ 8] = (temperature >> 0) & 0xff;
-  frametosend[ 9] = (humidity >> 8) & 0xff;
-  frametosend[10] = (humidity >> 0) & 0xff;
-  frametosend[11] = (particulatematter2_5u >> 8) & 0xff;
-  frametosend[12] = (particulatematter2_5u >> 0) & 0xff;
-  frametosend[13] = (particulatematter10u >> 8) & 0xff;
-  frametosend[14] = (particulatematter10u >> 0) & 0xff;
-  frametosend[15] = batvolt;
-  frametosend[16] = calculatecrc(frametosend, 16);
+  struct framebuilder f;
+  uint16_t now = timers_getticks();
+  frame_begin(&f, batchframe, sizeof(batchframe), 0xf7); /* FoxStaub batched */
+  frame_put8(&f, batchseq);
+  frame_put8(&f, batchnum);
+  for (uint8_t i = 0; i < batchnum; i++) {
+    uint16_t age = now - batchts[i];
+    frame_put8(&f, (age > 255) ? 255 : age);
+    frame_putbytes(&f, batchreadings[i], sizeof(batchreadings[0]));
+  }
+  batchseq += batchnum;
+  batchnum = 0;
+  return frame_finish(&f);
 }
+#endif /* BATCHEDFRAMES */
+
+#if defined(PMSYNCEDTX)
+/* Environment-only frame, sent when there is no new PM value.
+ *
+ * Byte  0: Startbyte (=0xCC)
+ * Byte  1: Sensor-ID (0 - 255/0xff)
+ * Byte  2: Number of data bytes that follow (9)
+ * Byte  3: Sensortype (=0xf9 for FoxStaub env-only)
+ * Byte  4-10: Same as bytes 4-10 of the normal frame (pressure,
+ *             temperature, humidity)
+ * Byte 11: battery voltage
+ * Byte 12: CRC
+ */
+/* Returns the length of the frame */
+static uint8_t prepareenvframe(void)
+{
+  struct framebuilder f;
+  frame_begin(&f, envframe, sizeof(envframe), 0xf9); /* FoxStaub env-only */
+  frame_put24(&f, pressure);
+  frame_put16(&f, temperature);
+  frame_put16(&f, humidity);
+  frame_put8(&f, batvolt);
+  return frame_finish(&f);
+}
+#endif /* PMSYNCEDTX */
+
+#if defined(ENERGYTELEMETRY)
+/* Fill the energy telemetry frame. This uses the same CustomSensor format
+ * as the normal frame, just with a different sensortype.
+ *
+ * Byte  0: Startbyte (=0xCC)
+ * Byte  1: Sensor-ID (0 - 255/0xff)
+ * Byte  2: Number of data bytes that follow (22)
+ * Byte  3: Sensortype (=0xf6 for FoxStaub energy telemetry)
+ * Byte  4- 6: SDS011 measuring time in seconds, MSB first
+ * Byte  7- 9: RFM69 standby time in seconds, MSB first
+ * Byte 10-12: RFM69 transmit time in seconds, MSB first
+ * Byte 13-15: ADC on time in seconds, MSB first
+ * Byte 16-18: TWI busy time in seconds, MSB first
+ * Byte 19-21: CPU awake time in seconds, MSB first
+ * Byte 22-24: Uptime in seconds, MSB first
+ * Byte 25: CRC
+ */
+/* Returns the length of the frame */
+static uint8_t prepareenergyframe(void)
+{
+  struct framebuilder f;
+  uint8_t i;
+  uint32_t secs;
+  uint16_t ms;
+  frame_begin(&f, energyframe, sizeof(energyframe), 0xf6); /* FoxStaub energy telemetry */
+  for (i = 0; i < 6; i++) { /* Radio RX is not part of the frame (yet) */
+    energy_get(i, &secs, &ms);
+    frame_put24(&f, secs);
+  }
+  frame_put24(&f, timers_getms() / 1000);
+  return frame_finish(&f);
+}
+#endif /* ENERGYTELEMETRY */
 
 void loadsettingsfromeeprom(void)
 {
@@ -128,40 +447,335 @@ void loadsettingsfromeeprom(void)
   if ((e1 ^ 0xff) == e2) { /* OK, the 'checksum' matches. Use this as our ID */
     sensorid = e1;
   }
+  e1 = eeprom_read_byte(&ee_radioprofile);
+  e2 = eeprom_read_byte(&ee_invradioprofile);
+  if (((e1 ^ 0xff) == e2) && (e1 < RFM69_NUMPROFILES)) {
+    radioprofile = e1;
+  }
+#if defined(DOWNLINKCONFIG)
+  struct nodesettings n;
+  eeprom_read_block(&n, &ee_settings, sizeof(n));
+  /* An all zero block has a valid CRC too, so check the values as well */
+  if ((crc8_calc((uint8_t *)&n, sizeof(n) - 1) == n.crc)
+   && (downlink_checksettings(&n))) {
+    settings = n;
+  }
+#endif /* DOWNLINKCONFIG */
 }
 
+#if defined(DOWNLINKCONFIG)
+/* Set the transmit power from the settings */
+static void applytxpower(void)
+{
+#if defined(ACKEDUPLINK)
+  radiolink_setmaxdbm(settings.txdbm);
+#else /* ACKEDUPLINK */
+  rfm69_setpower(settings.txdbm);
+#endif /* ACKEDUPLINK */
+}
+
+/* See whether the gateway has new settings for us */
+static void checkdownlink(void)
+{
+  if (downlink_listen(&settings)) {
+    console_printpgm_P(PSTR(" CONFIG "));
+    console_printdec(settings.seq);
+    applytxpower();
+  }
+}
+#endif /* DOWNLINKCONFIG */
+
+/* Handles for our scheduled jobs */
+static uint8_t txjob;
+static uint8_t sds011onjob;
+#if !defined(SDS011WORKINGPERIOD)
+static uint8_t sds011offjob;
+#endif /* !SDS011WORKINGPERIOD */
+#if defined(LISTENBEFORETALK) || defined(ACKEDUPLINK)
+static uint8_t sendjob; /* Retries transmit() after backing off */
+#endif /* LISTENBEFORETALK || ACKEDUPLINK */
+
+#if defined(LISTENBEFORETALK) || defined(ACKEDUPLINK)
+/* Run transmit() again after backing off for 'ms'. With TDMA that would
+ * land in somebody else's slot, so wait for our next one instead. */
+static void retrylater(uint16_t ms)
+{
+#if defined(TDMA)
+  if (tdma_issynced()) {
+    timers_setjob(sendjob, tdma_untilnextslot());
+    return;
+  }
+#endif /* TDMA */
+  timers_setjob(sendjob, TIMERS_MS(ms));
+}
+#endif /* LISTENBEFORETALK || ACKEDUPLINK */
+
+/* Send the frame txbuf points to (and the energy telemetry frame if it's
+ * due). With LISTENBEFORETALK or ACKEDUPLINK, this might instead decide to
+ * try again a bit later, from sendjob. */
+static void transmit(void)
+{
+  if (txlen == 0) { /* The frame did not fit into its buffer, that's a bug */
+    console_printpgm_P(PSTR(" TXOVERFLOW "));
+    return;
+  }
+  rfm69_setsleep(0);  /* This mainly turns on the oscillator again */
+#if defined(LISTENBEFORETALK)
+  if (!rfm69_channelfree(LBTRSSITHRESH)) {
+    if (lbtdefers < LBTMAXDEFERS) {
+      /* Somebody else is sending. Back off for a random time, with the
+       * window doubling each time we find the channel busy again. */
+      uint16_t backoff = LBTMINBACKOFFMS
+                       + (rnd_get16() % ((uint16_t)LBTBACKOFFWINMS << lbtdefers));
+      rfm69_setsleep(1);
+      lbtdefers++;
+      pktsdeferred++;
+      console_printpgm_P(PSTR(" LBT "));
+      retrylater(backoff);
+      return;
+    }
+    pktsforced++; /* We waited long enough, send anyways */
+  }
+  lbtdefers = 0;
+#endif /* LISTENBEFORETALK */
+  console_printpgm_P(txtag);
+#if defined(ACKEDUPLINK)
+  if (radiolink_send(txbuf, txlen)) {
+#if defined(DOWNLINKCONFIG)
+    /* Only listen if we know there is a gateway that heard us */
+    checkdownlink();
+#endif /* DOWNLINKCONFIG */
+  } else {
+    if ((txretries < RADIOLINK_MAXRETRIES) && radiolink_shouldretry()) {
+      rfm69_setsleep(1);
+      txretries++;
+      console_printpgm_P(PSTR(" NOACK "));
+      retrylater(ACKRETRYMINMS + (rnd_get16() % ACKRETRYWINMS));
+      return;
+    }
+    radiolink_lost();
+  }
+  txretries = 0;
+#else /* ACKEDUPLINK */
+  rfm69_sendarray(txbuf, txlen);
+#if defined(DOWNLINKCONFIG)
+  checkdownlink();
+#endif /* DOWNLINKCONFIG */
+#endif /* ACKEDUPLINK */
+#if defined(ENERGYTELEMETRY)
+  if ((pktssent % ENERGYTELEMETRYINTERVAL) == 0) {
+    uint8_t len = prepareenergyframe();
+    if (len > 0) {
+      rfm69_sendarray(energyframe, len);
+    }
+  }
+#endif /* ENERGYTELEMETRY */
+  rfm69_setsleep(1);
+  pktssent++;
+}
+
+/* Build the frame(s) from the current readings and send them */
+static void sendreadings(void)
+{
+#if defined(LISTENBEFORETALK) || defined(ACKEDUPLINK)
+  /* A new packet replaces one that is still waiting for a free channel
+   * or for being sent again */
+  timers_stopjob(sendjob);
+#endif /* LISTENBEFORETALK || ACKEDUPLINK */
+#if defined(LISTENBEFORETALK)
+  lbtdefers = 0;
+#endif /* LISTENBEFORETALK */
+#if defined(ACKEDUPLINK)
+  txretries = 0;
+#endif /* ACKEDUPLINK */
+#if defined(BATCHEDFRAMES)
+  addtobatch();
+  if (batchnum >= BATCHSIZE) {
+    txlen = preparebatchframe();
+    txbuf = batchframe;
+    txtag = PSTR(" TXB ");
+    transmit();
+  }
+#elif defined(PAYLOADV2)
+  txlen = prepareframev2();
+  txbuf = v2frame;
+  txtag = PSTR(" TX2 ");
+  transmit();
+#else /* BATCHEDFRAMES / PAYLOADV2 */
+  uint8_t envonly = 0;
+#if defined(PMSYNCEDTX)
+  envonly = !pmfresh; /* The PM values have already been sent */
+  if (envonly) {
+    txlen = prepareenvframe();
+    txbuf = envframe;
+    txtag = PSTR(" TXE ");
+  }
+#endif /* PMSYNCEDTX */
+  if (!envonly) {
+    txlen = prepareframe();
+    txbuf = frametosend;
+    txtag = PSTR(" TX ");
+  }
+  transmit();
+#endif /* BATCHEDFRAMES / PAYLOADV2 */
+#if defined(PMSYNCEDTX)
+  pmfresh = 0;
+#endif /* PMSYNCEDTX */
+}
+
+static void txjobfunc(void)
+{
+  struct sht3xdata temphum;
+  struct lps25hbdata lps25press;
+  /* Time to update values and send */
+  adc_power(1);
+  adc_start();
+  sht3x_read(&temphum);
+  if (temphum.valid) {
+    temperature = temphum.temp;
+    humidity = temphum.hum;
+  } else {
+    temperature = 0xffff;
+    humidity = 0xffff;
+  }
+  /* FIXME add LPS25HB here */
+  lps25hb_read(&lps25press);
+  if (lps25press.valid) {
+    pressure = ((uint32_t)lps25press.pressure[2] << 16)
+             | ((uint32_t)lps25press.pressure[1] <<  8)
+             | lps25press.pressure[0];
+  } else {
+    pressure = 0xffffff;
+  }
+  sht3x_startmeas(); /* Start the next measurement */
+  lps25hb_startmeas();
+  batvolt = adc_read() >> 2;
+  adc_power(0);
+  uint8_t oldlevel = powerpolicy_getlevel();
+  if (powerpolicy_update(batvolt) != oldlevel) {
+    console_printpgm_P(PSTR(" PWRLVL "));
+    console_printdec(powerpolicy_getlevel());
+  }
+  if (powerpolicy_pmallowed()) {
+    particulatematter2_5u = sds011_getlastpm2_5();
+    particulatematter10u = sds011_getlastpm10();
+  } else { /* Do not keep sending a stale value forever */
+    particulatematter2_5u = 0xffff;
+    particulatematter10u = 0xffff;
+  }
+  if (shouldsend()) {
+    sendreadings();
+  }
+#if defined(TDMA)
+  if (tdma_issynced()) { /* We will be scheduled into our next slot */
+    return;
+  }
+#endif /* TDMA */
+  /* Transmitinterval in ticks of 2.1s, so 15 = 31s. */
+  uint16_t transmitinterval;
+#if defined(LISTENBEFORETALK)
+  /* The low bits of the measurements are mostly noise */
+  rnd_addentropy((uint16_t)pressure ^ (uint16_t)temperature ^ humidity);
+  uint8_t rnd = rnd_get8() & 0x03;
+#else /* LISTENBEFORETALK */
+  /* We use the lowest two bits of pressure as random noise */
+  uint8_t rnd = pressure & 0x00000003;
+#endif /* LISTENBEFORETALK */
+  if (rnd == 3) {
+    transmitinterval = CFG_TXINTERVAL + 1;
+  } else if (rnd == 0) {
+    transmitinterval = CFG_TXINTERVAL - 1;
+  } else { /* 1 or 2 */
+    transmitinterval = CFG_TXINTERVAL;
+  }
+  timers_setjob(txjob, TIMERS_TICKS(transmitinterval * powerpolicy_getstretch()));
+}
+
+#if defined(PMSYNCEDTX)
+/* There is a new SDS011 result, send it right away instead of when the
+ * transmit job would run next. The next transmit interval starts from
+ * there. */
+static void pmresultready(void)
+{
+  pmfresh = 1;
+#if defined(TDMA)
+  if (tdma_issynced()) { /* It has to wait for our slot */
+    return;
+  }
+#endif /* TDMA */
+  timers_setjob(txjob, 0);
+}
+#endif /* PMSYNCEDTX */
+
+#if defined(SDS011WORKINGPERIOD)
+/* The SDS011 runs its own measurement cycle. All we do is stop it while
+ * there is not enough power, checked once per SDS011 cycle length. */
+static void sds011onjobfunc(void)
+{
+  timers_setjob(sds011onjob, TIMERS_TICKS((uint32_t)CFG_SDS011CYCLELENGTH * powerpolicy_getstretch()));
+  sds011_setmeasurements(powerpolicy_pmallowed());
+}
+#else /* SDS011WORKINGPERIOD */
+/* Start of an SDS011 measurement cycle */
+static void sds011onjobfunc(void)
+{
+  /* Rearm ourselves each time, because the cycle length depends on the
+   * power level. */
+  timers_setjob(sds011onjob, TIMERS_TICKS((uint32_t)CFG_SDS011CYCLELENGTH * powerpolicy_getstretch()));
+  if (!powerpolicy_pmallowed()) { /* Not enough power to measure at all */
+    return;
+  }
+  sds011_setmeasurements(1);
+  timers_setjob(sds011offjob, TIMERS_TICKS(CFG_SDS011CYCLEONTIME));
+}
+
+/* End of the measuring part of an SDS011 cycle */
+static void sds011offjobfunc(void)
+{
+  struct sds011stats st;
+  sds011_setmeasurements(0); /* Turn off, this also aggregates the result */
+  cli();
+  sds011_getstats_noirq(&st);
+  sei();
+  console_printpgm_P(PSTR(" SDSOFF "));
+  console_printdec((uint8_t)(st.ontimems / 1000));
+#if defined(PMSYNCEDTX)
+  if (st.num > 0) {
+    pmresultready();
+  }
+#endif /* PMSYNCEDTX */
+}
+#endif /* SDS011WORKINGPERIOD */
+
 int main(void)
 {
-  uint16_t lasttxts = 0xf000; /* This forces an update immediately after start */
-  uint16_t sds011cyclestart = 0xffff - (SDS011CYCLELENGTH / 2); /* places us at the end of a cycle */
-  uint16_t lastloopts = 0;
-  uint16_t curts;
-  uint16_t tsdiff;
-  uint8_t transmitinterval = 15; /* Transmitinterval in ticks of 2.1s, so 15 = 31s */
-  
   /* Initialize stuff */
   
   loadsettingsfromeeprom();
   
   adc_init();
   timers_init();
+#if defined(IRQLATENCY)
+  irqstats_init();
+#endif /* IRQLATENCY */
+  energy_on(ENERGY_CPU);
   console_init();
   rfm69_initport();
   /* The RFM69 needs some time to start up (5 ms according to data sheet, we wait 10 to be sure) */
   _delay_ms(10);
   rfm69_initchip();
+  rfm69_setprofile(radioprofile);
+#if defined(HWPACKET)
+  rfm69_setaddress(sensorid);
+#endif /* HWPACKET */
   rfm69_setsleep(1);
-  sht3x_init();
-  lps25hb_init();
   
   /* Enable watchdog timer with a timeout of 8 seconds */
   wdt_enable(WDTO_8S); /* Longest possible on ATmega328P */
   
   /* Disable unused chip parts and ports */
-  /* PE6 is the IRQ line from the RFM69. We don't use it. Make sure that pin
-   * is tristated on our side (it won't float, the RFM69 pulls it) */
-  PORTE &= (uint8_t)~_BV(PE6);
-  DDRE &= (uint8_t)~_BV(PE6);
+  /* PE6 is the IRQ line from the RFM69 (DIO0), rfm69_initport() has set
+   * it up. */
   /* Turn off unused stuff on the AVR via PRR registers */
   /* We don't use Timer0 */
   PRR0 |= _BV(PRTIM0);
@@ -182,84 +796,63 @@ int main(void)
   _delay_ms(2000);
   sds011_init();
 
-  /* Prepare sleep mode */
-  /* SLEEP_MODE_IDLE is the only sleepmode we can safely use. */
-  set_sleep_mode(SLEEP_MODE_IDLE);
-  sleep_enable();
-
   /* All set up, enable interrupts and go. */
   sei();
 
+  /* TWI transactions are interrupt driven, so the sensors on the bus can
+   * only be initialized now. */
+  twi_init();
+  sht3x_init();
+  lps25hb_init();
+
+  /* Set up our jobs. This forces an update immediately after start, and
+   * places us in the middle of an SDS011 cycle */
+  txjob = timers_addjob(txjobfunc, 0, 0);
+  sds011onjob = timers_addjob(sds011onjobfunc, TIMERS_TICKS(CFG_SDS011CYCLELENGTH / 2), 0);
+#if !defined(SDS011WORKINGPERIOD)
+  sds011offjob = timers_addjob(sds011offjobfunc, 0, 0);
+  timers_stopjob(sds011offjob);
+#endif /* !SDS011WORKINGPERIOD */
+#if defined(LISTENBEFORETALK) || defined(ACKEDUPLINK)
+  rnd_addentropy(((uint16_t)sensorid << 8) | sensorid);
+  sendjob = timers_addjob(transmit, 0, 0);
+  timers_stopjob(sendjob);
+#endif /* LISTENBEFORETALK || ACKEDUPLINK */
+#if defined(ACKEDUPLINK)
+  radiolink_init();
+#endif /* ACKEDUPLINK */
+#if defined(DOWNLINKCONFIG)
+  applytxpower();
+#endif /* DOWNLINKCONFIG */
+#if defined(TDMA)
+  tdma_init(txjob);
+#endif /* TDMA */
+
   while (1) {
     wdt_reset();
-    curts = timers_getticks();
-    tsdiff = curts - lasttxts;
-    if (tsdiff >= transmitinterval) {
-      struct sht3xdata temphum;
-      struct lps25hbdata lps25press;
-      /* Time to update values and send */
-      adc_power(1);
-      adc_start();
-      sht3x_read(&temphum);
-      if (temphum.valid) {
-        temperature = temphum.temp;
-        humidity = temphum.hum;
-      } else {
-        temperature = 0xffff;
-        humidity = 0xffff;
-      }
-      /* FIXME add LPS25HB here */
-      lps25hb_read(&lps25press);
-      if (lps25press.valid) {
-        pressure = ((uint32_t)lps25press.pressure[2] << 16)
-                 | ((uint32_t)lps25press.pressure[1] <<  8)
-                 | lps25press.pressure[0];
-      } else {
-        pressure = 0xffffff;
-      }
-      particulatematter2_5u = sds011_getlastpm2_5();
-      particulatematter10u = sds011_getlastpm10();
-      sht3x_startmeas(); /* Start the next measurement */
-      lps25hb_startmeas();
-      batvolt = adc_read() >> 2;
-      adc_power(0);
-      /* SEND */
-      rfm69_setsleep(0);  /* This mainly turns on the oscillator again */
-      prepareframe();
-      console_printpgm_P(PSTR(" TX "));
-      rfm69_sendarray(frametosend, 18);
-      rfm69_setsleep(1);
-      pktssent++;
-      lasttxts = curts; /* Remember when we last sent a packet */
-      /* We use the lowest two bits of pressure as random noise */
-      uint8_t rnd = pressure & 0x00000003;
-      if (rnd == 3) {
-        transmitinterval = 17;
-      } else if (rnd == 0) {
-        transmitinterval = 15;
-      } else { /* 1 or 2 */
-        transmitinterval = 16;
-      }
+    sds011_work();
+#if defined(SDS011WORKINGPERIOD)
+    if (sds011_hasnewresult()) { /* The SDS011 pushed a result on its own */
+      console_printpgm_P(PSTR(" SDSRES "));
+#if defined(PMSYNCEDTX)
+      pmresultready();
+#endif /* PMSYNCEDTX */
     }
-    tsdiff = curts - lastloopts;
-    if (tsdiff > 0) { /* OK, we had one tick. (we need to make sure we execute only once per tick!) */
-      lastloopts = curts;
-      tsdiff = curts - sds011cyclestart;
-      if (tsdiff >= SDS011CYCLELENGTH) { /* Cycle over - start again */
-        sds011cyclestart = curts;
-        sds011_setmeasurements(1);
-      } else if (tsdiff == SDS011CYCLEONTIME) {
-        sds011_requestresult(); /* Request latest result */
-        sds011_setmeasurements(0); /* Then turn off */
-      }
+#else /* SDS011WORKINGPERIOD */
+    if (sds011_hasconverged()) { /* No need to wait for the maximum on-time */
+      timers_setjob(sds011offjob, 0);
     }
+#endif /* SDS011WORKINGPERIOD */
+#if defined(TDMA)
+    tdma_work();
+#endif /* TDMA */
+    timers_runjobs();
     console_work();
     if (!console_isusbconfigured()) {
       /* Don't go to sleep when USB is configured. Because then there is no
        * lack of power, and more importantly, we want the console to feel
        * "snappy" and we can't get that if we sleep for 2 second. */
-      wdt_reset(); /* Buy us 8 seconds time because the next IRQ might only arrive in 2 seconds */
-      sleep_cpu(); /* Go to sleep until the next IRQ arrives */
+      lowpower_sleep(); /* Go to sleep until the next IRQ or job arrives */
     }
   }
 }
@@ -0,0 +1,66 @@
+/* $Id: powerpolicy.c $
+ * Battery-aware power policy: Decides how often we may measure and send,
+ * depending on the battery voltage.
+ *
+ * The SDS011 is by far the biggest consumer, so as the battery voltage
+ * falls, we stretch its cycle (and our transmit interval) more and more,
+ * and below a cutoff we stop measuring PM completely. Temperature, humidity,
+ * pressure and battery voltage are still sent, so we can see when the
+ * battery recovers.
+ */
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "powerpolicy.h"
+
+/* Thresholds in the raw battery unit (volts / 0.11) for a 12V AGM battery:
+ * below THRESH[n] we drop from level n to level n+1. */
+static const uint8_t PROGMEM thresholds[3] = {
+  111,  /* 12.2 V */
+  108,  /* 11.9 V */
+  105,  /* 11.6 V */
+};
+/* To go back up a level, the voltage needs to be this much above the
+ * threshold, so we do not flip back and forth with every measurement. */
+#define HYSTERESIS 2 /* 0.22 V */
+/* Anything below this is not a battery, e.g. when we're powered from USB
+ * without the voltage divider being connected. */
+#define NOBATTERY 45 /* 5 V */
+
+static const uint8_t PROGMEM stretches[4] = { 1, 2, 4, 4 };
+
+static uint8_t level = POWERLEVEL_NORMAL;
+
+uint8_t powerpolicy_update(uint8_t batvolt)
+{
+  if (batvolt < NOBATTERY) {
+    level = POWERLEVEL_NORMAL;
+    return level;
+  }
+  /* Go down as far as needed */
+  while ((level < POWERLEVEL_CRITICAL)
+      && (batvolt < pgm_read_byte(&thresholds[level]))) {
+    level++;
+  }
+  /* Go up only with some margin */
+  while ((level > POWERLEVEL_NORMAL)
+      && (batvolt >= (pgm_read_byte(&thresholds[level - 1]) + HYSTERESIS))) {
+    level--;
+  }
+  return level;
+}
+
+uint8_t powerpolicy_getlevel(void)
+{
+  return level;
+}
+
+uint8_t powerpolicy_getstretch(void)
+{
+  return pgm_read_byte(&stretches[level]);
+}
+
+uint8_t powerpolicy_pmallowed(void)
+{
+  return (level < POWERLEVEL_CRITICAL);
+}
@@ -0,0 +1,29 @@
+/* $Id: powerpolicy.h $
+ * Battery-aware power policy: Decides how often we may measure and send,
+ * depending on the battery voltage.
+ */
+
+#ifndef _POWERPOLICY_H_
+#define _POWERPOLICY_H_
+
+/* The power levels, from "plenty of power" to "nearly empty" */
+#define POWERLEVEL_NORMAL   0
+#define POWERLEVEL_SAVE     1
+#define POWERLEVEL_LOW      2
+#define POWERLEVEL_CRITICAL 3
+
+/* Feed a new battery voltage measurement (in the same raw unit as sent in
+ * the frame, i.e. volts / 0.11) into the policy. Returns the new level. */
+uint8_t powerpolicy_update(uint8_t batvolt);
+
+/* Returns the current power level */
+uint8_t powerpolicy_getlevel(void);
+
+/* Returns by how much the SDS011 cycle and the transmit interval should be
+ * stretched at the current power level. */
+uint8_t powerpolicy_getstretch(void);
+
+/* Returns whether we may run the SDS011 at all at the current level. */
+uint8_t powerpolicy_pmallowed(void);
+
+#endif /* _POWERPOLICY_H_ */
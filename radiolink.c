@@ -0,0 +1,144 @@
+/* $Id: radiolink.c $
+ * Acknowledged sending, with retransmissions and automatic transmit power
+ * control.
+ *
+ * After each frame, we listen for a short time for an ACK from the gateway.
+ * ACK format (fixed 5 bytes):
+ * Byte 0: 0xAC
+ * Byte 1: Sensor ID of the sensor the ACK is for
+ * Byte 2: CRC8 over the acknowledged frame, as the gateway received it, but
+ *         without the frame's own trailing CRC8 byte - so this is simply
+ *         that byte echoed back. With HWPACKET, frames have no CRC8 byte
+ *         and this is the CRC8 over the whole frame.
+ * Byte 3: RSSI the gateway received the frame with, in the raw unit of
+ *         RegRssiValue, that is -2 * dBm
+ * Byte 4: CRC8 over bytes 0 - 3
+ *
+ * From the RSSI, we know how much margin the link has, and turn the
+ * transmit power down if there is more than we need - that saves a lot of
+ * energy for sensors close to the gateway. A missing ACK turns it up again.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "crc8.h"
+#include "radiolink.h"
+#include "rfm69.h"
+
+#if defined(ACKEDUPLINK)
+
+#define ACKLEN 5
+#define ACKMARKER 0xAC
+/* How long we wait for the ACK. The gateway needs a moment to switch from
+ * RX to TX, and the ACK itself takes about 5 ms. */
+#define RADIOLINK_ACKWINDOWMS 30
+/* We try to keep the signal at the gateway at around -85 dBm: The RFM69
+ * can still receive about -100 dBm at our data rate, so that leaves 15 dB
+ * for fading. We only turn the power down when there is more than
+ * RADIOLINK_HYSTDB on top of that, so it does not flip back and forth. */
+#define RADIOLINK_TARGETDBM (-85)
+#define RADIOLINK_HYSTDB 6
+/* How much to turn the power up on a missing ACK */
+#define RADIOLINK_NOACKSTEPDB 3
+/* After this many frames in a row that were lost completely, assume there
+ * is no gateway that sends ACKs, and stop retrying until we get one. */
+#define RADIOLINK_GIVEUP 4
+
+extern uint8_t sensorid;
+
+static int8_t txdbm = RFM69_MAXDBM;
+static int8_t maxdbm = RFM69_MAXDBM;
+static uint8_t lastgwrssi = 0;
+static uint8_t lostinrow = 0;
+static uint32_t acked = 0;
+static uint32_t retries = 0;
+static uint32_t lost = 0;
+
+static void setpower(int8_t dbm)
+{
+  if (dbm < RFM69_MINDBM) {
+    dbm = RFM69_MINDBM;
+  } else if (dbm > maxdbm) {
+    dbm = maxdbm;
+  }
+  txdbm = dbm;
+  rfm69_setpower(dbm);
+}
+
+/* Adapt the transmit power to the RSSI the gateway reported */
+static void adaptpower(uint8_t gwrssi)
+{
+  int8_t margin = (int8_t)(-(int16_t)(gwrssi / 2) - RADIOLINK_TARGETDBM);
+  if (margin < 0) { /* Too weak, go up right away */
+    setpower(txdbm - margin);
+  } else if (margin > RADIOLINK_HYSTDB) {
+    /* Go down in small steps, because the ACKs we do not get at too low
+     * a power are more expensive than a few frames sent a bit too loud */
+    setpower(txdbm - ((margin - RADIOLINK_HYSTDB + 1) / 2));
+  }
+}
+
+void radiolink_init(void)
+{
+  setpower(maxdbm);
+}
+
+void radiolink_setmaxdbm(int8_t dbm)
+{
+  maxdbm = dbm;
+  if (txdbm > maxdbm) {
+    setpower(maxdbm);
+  }
+}
+
+uint8_t radiolink_send(uint8_t * buf, uint8_t len)
+{
+  uint8_t ack[ACKLEN];
+  /* A CRC8 over a frame including its own CRC8 is always 0, so leave
+   * that out, else every ACK would match every frame. */
+#if defined(HWPACKET)
+  uint8_t framecrc = crc8_calc(buf, len);
+#else /* HWPACKET */
+  uint8_t framecrc = crc8_calc(buf, len - 1);
+#endif /* HWPACKET */
+  rfm69_sendarray(buf, len);
+  if ((rfm69_receive(ack, ACKLEN, RADIOLINK_ACKWINDOWMS))
+   && (ack[0] == ACKMARKER) && (ack[1] == sensorid) && (ack[2] == framecrc)
+   && (crc8_calc(ack, ACKLEN - 1) == ack[ACKLEN - 1])) {
+    lastgwrssi = ack[3];
+    lostinrow = 0;
+    acked++;
+    adaptpower(lastgwrssi);
+    return 1;
+  }
+  setpower(txdbm + RADIOLINK_NOACKSTEPDB);
+  return 0;
+}
+
+uint8_t radiolink_shouldretry(void)
+{
+  if (lostinrow >= RADIOLINK_GIVEUP) {
+    return 0;
+  }
+  retries++;
+  return 1;
+}
+
+void radiolink_lost(void)
+{
+  lost++;
+  if (lostinrow < RADIOLINK_GIVEUP) {
+    lostinrow++;
+  }
+}
+
+void radiolink_getstats_noirq(struct radiolinkstats * s)
+{
+  s->txdbm = txdbm;
+  s->gwrssi = lastgwrssi;
+  s->acked = acked;
+  s->retries = retries;
+  s->lost = lost;
+}
+
+#endif /* ACKEDUPLINK */
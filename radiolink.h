@@ -0,0 +1,41 @@
+/* $Id: radiolink.h $
+ * Acknowledged sending, with retransmissions and automatic transmit power
+ * control.
+ */
+
+#ifndef _RADIOLINK_H_
+#define _RADIOLINK_H_
+
+/* How often a frame gets sent again when the ACK is missing */
+#define RADIOLINK_MAXRETRIES 3
+
+/* Initialize, i.e. set the starting transmit power. The radio must have
+ * been initialized. */
+void radiolink_init(void);
+
+/* Limit the transmit power to 'dbm' (RFM69_MINDBM - RFM69_MAXDBM). */
+void radiolink_setmaxdbm(int8_t dbm);
+
+/* Send a frame and wait for the gateway to acknowledge it. The radio must
+ * be in standby. Returns 1 if the ACK arrived. Either way, the transmit
+ * power gets adapted. */
+uint8_t radiolink_send(uint8_t * buf, uint8_t len);
+
+/* Should a frame that was not acknowledged be sent again? This returns 0
+ * while we seem to have no gateway that sends ACKs at all. */
+uint8_t radiolink_shouldretry(void);
+
+/* Tell us that a frame was given up on after all retries. */
+void radiolink_lost(void);
+
+struct radiolinkstats {
+  int8_t txdbm;         /* Current transmit power */
+  uint8_t gwrssi;       /* RSSI at the gateway in the last ACK (-2 * dBm) */
+  uint32_t acked;       /* Frames acknowledged */
+  uint32_t retries;     /* Frames sent again */
+  uint32_t lost;        /* Frames given up on */
+};
+/* Fetch statistics. Call with interrupts disabled. */
+void radiolink_getstats_noirq(struct radiolinkstats * s);
+
+#endif /* _RADIOLINK_H_ */
@@ -7,9 +7,12 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include <util/delay.h>
-#include <math.h>
+#include <avr/pgmspace.h>
+#include "energy.h"
 #include "rfm69.h"
+#include "timers.h"
 #include "lufa/console.h"
 
 /* Pin mappings:
@@ -19,6 +22,7 @@
  *  SCK    PB1
  *  RESET  PD4
  *  OUROWNSS PB0 (not used!)
+ *  DIO0   PE6 (INT6)
  */
 #define RFMDDR   DDRB
 #define RFMPIN   PINB
@@ -31,13 +35,82 @@
 #define RFMPIN_OURSS PB0
 
 #define RFM_FREQUENCY 868300UL
-#define RFM_DATARATE 17241.0
+
+/* Set Frequency
+ * The datasheet is horrible to read at that point, never stating a clear
+ * formula ready for use.
+ * F(Step) = F(XOSC) / (2 ** 19)      2 ** 19 = 524288
+ * F(forreg) = FREQUENCY_IN_HZ / F(Step) */
+#define RFM_FREQREG ((((RFM_FREQUENCY * 1000ULL) << 19) + 16000000ULL) / 32000000ULL)
+/* Datarate register: F(XOSC) / datarate, rounded */
+#define RFM_DRREG(rate) ((32000000UL + ((rate) / 2)) / (rate))
+/* Frequency deviation register: deviation / F(Step), rounded */
+#define RFM_FDEVREG(hz) ((((hz) << 19) + 16000000ULL) / 32000000ULL)
+
+/* Everything that depends on the data rate. The receiver bandwidth has to
+ * cover 2 * (deviation + datarate / 2), and the higher rates get a bit
+ * more preamble so the receiver has time to settle. */
+struct rfm69profile {
+  uint8_t bitrate[2];   /* RegBitrateMsb / Lsb */
+  uint8_t fdev[2];      /* RegFdevMsb / Lsb */
+  uint8_t rxbw;         /* RegRxBw */
+  uint8_t afcbw;        /* RegAfcBw */
+  uint8_t preamble;     /* RegPreambleLsb */
+  uint16_t bytetimeus;  /* How long one byte takes on air */
+};
+#define RFM_PROFILE(rate, dev, bw, pre) { \
+  { (RFM_DRREG(rate) >> 8) & 0xff, RFM_DRREG(rate) & 0xff }, \
+  { (RFM_FDEVREG(dev) >> 8) & 0xff, RFM_FDEVREG(dev) & 0xff }, \
+  (bw), (bw), (pre), (8000000UL + ((rate) - 1)) / (rate) }
+static const struct rfm69profile PROGMEM profiles[RFM69_NUMPROFILES] = {
+  /* 0: 17241 baud, like the LaCrosse sensors and the Jeelink sketch. The
+   * RxBw (DccFreq 010, 125 kHz) is what we always used, we don't receive
+   * at this rate anyways. */
+  RFM_PROFILE(17241UL, 90000ULL, 0x42, 3),
+  /* 1: 9579 baud, the rate of older LaCrosse sensors. The Jeelink sketch
+   * can receive this too (it toggles between the rates). */
+  RFM_PROFILE(9579UL, 90000ULL, 0x42, 3),
+  /* 2: 38400 baud, 40 kHz deviation, RxBw 125 kHz */
+  RFM_PROFILE(38400UL, 40000ULL, 0x42, 4),
+  /* 3: 76800 baud, 75 kHz deviation, RxBw 250 kHz */
+  RFM_PROFILE(76800UL, 75000ULL, 0x41, 5),
+};
 
 #define PAYLOADSIZE 64
 
+/* How long we wait for the PacketSent IRQ at most: Half again as long as
+ * the packet takes on air at the current data rate, plus RFM69_TXSLACKMS
+ * for the transmitter to start up. A packet of 18 bytes takes about 11 ms
+ * at 17241 baud, a full one about 60 ms at 9579 baud. */
+#define RFM69_TXSLACKMS 10
+static uint16_t bytetimeus = 464;   /* of the active profile */
+static uint8_t preamblelen = 3;     /* of the active profile */
+
+/* Set by the DIO0 IRQ when the RFM69 signals PacketSent */
+static volatile uint8_t txdone = 0;
+#if defined(RFM69_RX)
+/* Are we receiving, and when did the DIO0 IRQ signal PayloadReady? */
+static uint8_t rxactive = 0;
+static uint32_t rxts;
+#if defined(HWPACKET)
+static uint8_t rxlen; /* The payload length we are waiting for */
+#endif /* HWPACKET */
+#endif /* RFM69_RX */
+
 ISR(INT6_vect)
 {
-  /* Nothing to do here. */
+  /* DIO0 is mapped to PacketSent while in TX mode (and PayloadReady while
+   * in RX mode). It stays high until we leave that mode / read the FIFO,
+   * so disable the IRQ until the next packet. */
+  EIMSK &= (uint8_t)~_BV(INT6);
+#if defined(RFM69_RX)
+  if (rxactive) {
+    /* Safe in here: Main code reads TIMER1 with interrupts disabled, so
+     * we cannot clobber its TEMP register access. */
+    rxts = timers_getcounts();
+  }
+#endif /* RFM69_RX */
+  txdone = 1;
 }
 
 ISR(SPI_STC_vect)
@@ -49,31 +122,44 @@ ISR(SPI_STC_vect)
  * has to do that! */
 static uint8_t rfm69_spi8(uint8_t value) {
   SPDR = value;
-  /* busy-wait for transmission. this loop spins 4 usec with a 2 MHz SPI clock */
+  /* busy-wait for transmission. this loop spins 2 usec with a 4 MHz SPI clock */
   while (!(SPSR & _BV(SPIF))) { }
 
   return SPDR;
 }
 
-uint16_t rfm69_spi16(uint16_t value) {
-  _delay_us(1);
+/* The RFM69 only needs some ns between SS changes and the clock, which is
+ * less than one instruction for us, so no delays needed here. */
+static inline void rfm69_select(void) {
   RFMPORT &= (uint8_t)~_BV(RFMPIN_SS);
-  _delay_us(1);
-  uint16_t reply = rfm69_spi8(value >> 8) << 8;
-  reply |= rfm69_spi8(value & 0xff);
-  _delay_us(1);
+}
+
+static inline void rfm69_deselect(void) {
   RFMPORT |= _BV(RFMPIN_SS);
-  _delay_us(1);
-  
-  return reply;
 }
 
 uint8_t rfm69_readreg(uint8_t reg) {
-  return rfm69_spi16(((uint16_t)(reg & 0x7f) << 8) | 0x00) & 0xff;
+  uint8_t res;
+  rfm69_select();
+  rfm69_spi8(reg & 0x7f);
+  res = rfm69_spi8(0x00);
+  rfm69_deselect();
+  return res;
 }
 
 static void rfm69_writereg(uint8_t reg, uint8_t val) {
-  rfm69_spi16(((uint16_t)(reg | 0x80) << 8) | val);
+  rfm69_select();
+  rfm69_spi8(reg | 0x80);
+  rfm69_spi8(val);
+  rfm69_deselect();
+}
+
+/* Shadow of RegOpMode, so mode changes do not need to read it first */
+static uint8_t opmode = 0x04;
+
+static void rfm69_setmode(uint8_t mode) {
+  opmode = (opmode & 0xE3) | mode;
+  rfm69_writereg(0x01, opmode);
 }
 
 void rfm69_clearfifo(void) {
@@ -85,52 +171,253 @@ void rfm69_clearfifo(void) {
 void rfm69_settransmitter(uint8_t e) {
   if (e) {
     /* RegOpMode => TRANSMIT */
-    rfm69_writereg(0x01, (rfm69_readreg(0x01) & 0xE3) | 0x0C);
+    rfm69_setmode(0x0C);
+    energy_off(ENERGY_RADIOSTBY);
+    energy_on(ENERGY_RADIOTX);
   } else {
     /* RegOpMode => STANDBY */
-    rfm69_writereg(0x01, (rfm69_readreg(0x01) & 0xE3) | 0x04);
+    rfm69_setmode(0x04);
+    energy_off(ENERGY_RADIOTX);
+    energy_on(ENERGY_RADIOSTBY);
   }
 }
 
 void rfm69_setsleep(uint8_t s) {
   if (s) {
     /* RegOpMode => SLEEP */
-    rfm69_writereg(0x01, (rfm69_readreg(0x01) & 0xE3) | 0x00);
+    rfm69_setmode(0x00);
+    energy_off(ENERGY_RADIOTX);
+    energy_off(ENERGY_RADIOSTBY);
   } else {
     /* RegOpMode => STANDBY */
-    rfm69_writereg(0x01, (rfm69_readreg(0x01) & 0xE3) | 0x04);
+    rfm69_setmode(0x04);
+    energy_on(ENERGY_RADIOSTBY);
     while (!(rfm69_readreg(0x27) & 0x80)) { /* Wait until ready */ }
   }
 }
 
+#if defined(LISTENBEFORETALK)
+/* How long we wait for the receiver to be ready, or for an RSSI sample */
+#define RFM69_RSSITIMEOUTMS 5
+
+/* Wait until the bits in 'mask' are set in register 'reg'. Returns 0 if
+ * that did not happen within RFM69_RSSITIMEOUTMS. */
+static uint8_t waitforreg(uint8_t reg, uint8_t mask) {
+  uint32_t start = timers_getms();
+  while (!(rfm69_readreg(reg) & mask)) {
+    if ((timers_getms() - start) > RFM69_RSSITIMEOUTMS) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* The radio did not answer while we measured. Say the channel is free
+ * rather than deferring for nothing, sending will tell if it really is
+ * broken. Any samples taken so far are not used, so a dead radio is
+ * handled the same no matter at which point it stopped answering. */
+static uint8_t rssitimedout(void) {
+  rfm69_setmode(0x04); /* RegOpMode => STANDBY */
+  console_printpgm_P(PSTR("![RSSI TIMED OUT]!"));
+  return 1;
+}
+
+uint8_t rfm69_channelfree(uint8_t thresh) {
+  uint8_t strongest = 0xff;
+  /* RegOpMode => RECEIVE. This is only for a millisecond or so, so we
+   * just count it as standby time in the energy accounting. */
+  rfm69_setmode(0x10);
+  /* RegIrqFlags1 -> RxReady: the RSSI is only valid once the receiver
+   * is up, ModeReady alone comes too early. */
+  if (!waitforreg(0x27, 0x40)) {
+    return rssitimedout();
+  }
+  for (uint8_t i = 0; i < 4; i++) {
+    /* RegRssiConfig -> RssiStart, then wait for RssiDone */
+    rfm69_writereg(0x23, 0x01);
+    if (!waitforreg(0x23, 0x02)) {
+      return rssitimedout();
+    }
+    uint8_t rssi = rfm69_readreg(0x24); /* RegRssiValue */
+    if (rssi < strongest) { /* Smaller values mean a stronger signal */
+      strongest = rssi;
+    }
+  }
+  /* RegOpMode => STANDBY */
+  rfm69_setmode(0x04);
+  /* Smaller raw values are stronger, so "at or above" the threshold in
+   * dBm is less or equal in raw */
+  return (strongest > thresh);
+}
+#endif /* LISTENBEFORETALK */
+
+#if defined(ACKEDUPLINK) || defined(DOWNLINKCONFIG)
+void rfm69_setpower(int8_t dbm) {
+  /* RegPaLevel -> Pa0=0 Pa1=1 Pa2=0 Outputpower = dBm + 18 */
+  rfm69_writereg(0x11, 0x40 | (uint8_t)(dbm + 18));
+}
+#endif /* ACKEDUPLINK || DOWNLINKCONFIG */
+
+#if defined(RFM69_RX)
+void rfm69_startrx(uint8_t len) {
+#if defined(HWPACKET)
+  rxlen = len;
+#else /* HWPACKET */
+  rfm69_writereg(0x38, len); /* RegPayloadLength */
+#endif /* HWPACKET */
+  rfm69_clearfifo();
+  /* RegDioMapping1 -> DIO0 = 01, which is PayloadReady in RX mode */
+  rfm69_writereg(0x25, 0x40);
+  cli();
+  txdone = 0;
+  rxactive = 1;
+  EIFR = _BV(INTF6); /* Clear stale flag */
+  EIMSK |= _BV(INT6);
+  sei();
+  /* RegOpMode => RECEIVE */
+  rfm69_setmode(0x10);
+  energy_off(ENERGY_RADIOSTBY);
+  energy_on(ENERGY_RADIORX);
+}
+
+uint8_t rfm69_rxdone(uint32_t * ts) {
+  uint8_t res;
+  cli();
+  res = txdone;
+  *ts = rxts;
+  sei();
+  return res;
+}
+
+uint8_t rfm69_readfifo(uint8_t * buf, uint8_t len) {
+  rfm69_select();
+  rfm69_spi8(0x00); /* Select RegFifo (0x00) for reading */
+#if defined(HWPACKET)
+  /* Length byte and address byte come first. The address has already
+   * been checked by the radio, as has the CRC. */
+  uint8_t plen = rfm69_spi8(0x00);
+  rfm69_spi8(0x00);
+  if ((plen != (len + 1)) || (len != rxlen)) {
+    rfm69_deselect();
+    return 0;
+  }
+#endif /* HWPACKET */
+  for (uint8_t i = 0; i < len; i++) {
+    buf[i] = rfm69_spi8(0x00);
+  }
+  rfm69_deselect();
+  return 1;
+}
+
+void rfm69_stoprx(void) {
+  cli();
+  EIMSK &= (uint8_t)~_BV(INT6);
+  rxactive = 0;
+  sei();
+  /* RegOpMode => STANDBY */
+  rfm69_setmode(0x04);
+  energy_off(ENERGY_RADIORX);
+  energy_on(ENERGY_RADIOSTBY);
+  /* RegDioMapping1 -> back to PacketSent for sending */
+  rfm69_writereg(0x25, 0x00);
+}
+
+uint8_t rfm69_isrxactive_noirq(void) {
+  return rxactive;
+}
+
+/* Longest wait per round in rfm69_receive(), must fit 16 bit TIMER1 counts */
+#define RFM69_RXWAKEUPMS 2000
+
+uint8_t rfm69_receive(uint8_t * buf, uint8_t len, uint16_t timeoutms) {
+  uint32_t rxstart = timers_getms();
+  uint8_t got;
+  rfm69_startrx(len);
+  /* Same as waiting for PacketSent in rfm69_sendarray() */
+  cli();
+  while (!txdone) {
+    uint32_t waited = timers_getms() - rxstart;
+    if (waited > timeoutms) {
+      break;
+    }
+    /* The wakeup can be at most one TIMER1 period (about 2 s) away, so
+     * longer timeouts take several rounds. */
+    uint16_t left = timeoutms - waited + 1; /* +1: the check above is '>' */
+    if (left > RFM69_RXWAKEUPMS) {
+      left = RFM69_RXWAKEUPMS;
+    }
+    timers_wakeupin_noirq(TIMERS_MS(left));
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    cli();
+  }
+  got = txdone;
+  sei();
+  if (got) {
+    got = rfm69_readfifo(buf, len);
+  }
+  rfm69_stoprx();
+  return got;
+}
+#endif /* RFM69_RX */
+
 void rfm69_sendarray(uint8_t * data, uint8_t length) {
+#if !defined(HWPACKET)
   /* Set the length of our payload */
   rfm69_writereg(0x38, length);
+#endif /* !HWPACKET */
   rfm69_clearfifo(); /* Clear the FIFO */
   /* Now fill the FIFO. We manually set SS and use spi8 because this
    * is the only "register" that is larger than 8 bits. */
-  _delay_us(1);
-  RFMPORT &= (uint8_t)~_BV(RFMPIN_SS);
-  _delay_us(1);
+  rfm69_select();
   rfm69_spi8(0x80); /* Select RegFifo (0x00) for writing (|0x80) */
+#if defined(HWPACKET)
+  /* In variable length mode, the length byte goes first */
+  rfm69_spi8(length);
+#endif /* HWPACKET */
   for (int i = 0; i < length; i++) {
     rfm69_spi8(data[i]);
   }
-  _delay_us(1);
-  RFMPORT |= _BV(RFMPIN_SS);
-  _delay_us(1);
+  rfm69_deselect();
+  /* Arm the PacketSent IRQ on DIO0 */
+  txdone = 0;
+  EIFR = _BV(INTF6); /* Clear stale flag */
+  EIMSK |= _BV(INT6);
   /* FIFO has been filled. Tell the RFM69 to send by just turning on the transmitter. */
   rfm69_settransmitter(1);
-  /* Wait for transmission to finish, visible in RegIrqFlags2. */
-  uint8_t reg28 = 0x00;
-  uint16_t maxreps = 10000;
-  while (!(reg28 & 0x08)) {
-    reg28 = rfm69_readreg(0x28);
-    maxreps--;
-    if (maxreps == 0) {
-      console_printpgm_P(PSTR("![TX TIMED OUT]!"));
+  /* Sleep until the transmission has finished. This needs to be idle mode,
+   * because we need TIMER1 for the timeout. */
+  uint32_t txstart = timers_getms();
+  uint8_t timedout = 0;
+  /* Preamble, 2 bytes sync word, payload, and with HWPACKET the length
+   * byte and the CRC16 */
+  uint16_t onairbytes = (uint16_t)preamblelen + 2 + length;
+#if defined(HWPACKET)
+  onairbytes += 3;
+#endif /* HWPACKET */
+  uint16_t timeoutms = (uint16_t)(((uint32_t)onairbytes * bytetimeus * 3) / 2000)
+                     + RFM69_TXSLACKMS;
+  cli();
+  while (!txdone) {
+    if ((timers_getms() - txstart) > timeoutms) {
+      EIMSK &= (uint8_t)~_BV(INT6);
+      timedout = 1;
       break;
     }
+    timers_wakeupin_noirq(TIMERS_MS(timeoutms));
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    cli();
+  }
+  sei();
+  if (timedout) {
+    console_printpgm_P(PSTR("![TX TIMED OUT]!"));
   }
   rfm69_settransmitter(0);
 }
@@ -152,82 +439,130 @@ void rfm69_initport(void) {
   RFMDDR |= _BV(RFMPIN_OURSS);
 
   RFMPORT |= _BV(RFMPIN_SS);
+  /* DIO0 of the RFM69 is connected to PE6 / INT6. The RFM69 drives it, so
+   * no pullup. We trigger on the rising edge, but only enable the IRQ while
+   * sending. */
+  DDRE &= (uint8_t)~_BV(PE6);
+  PORTE &= (uint8_t)~_BV(PE6);
+  EICRB = (EICRB & (uint8_t)~(_BV(ISC61) | _BV(ISC60))) | _BV(ISC61) | _BV(ISC60);
   
   /* Enable hardware SPI, no need to manually do it.
-   * set master mode with rate clk/4 = 2 MHz (maximum of RFM69 is unknown) */
+   * set master mode with rate clk/2 = 4 MHz (SPI2X). The RFM69 can do up
+   * to 10 MHz, so this is as fast as we can go. */
   SPCR = _BV(SPE) | _BV(MSTR);
-  SPSR = 0x00; /* To set SPI2X to 0, rest is read-only anyways */
+  SPSR = _BV(SPI2X);
   
   _delay_us(200); /* 100us minimum time the RESET pin needs to be pulled high on the RFM */
   PORTD &= (uint8_t)~_BV(PD4);
 }
 
-void rfm69_initchip(void) {
+/* The register values rfm69_initchip() sets, as pairs of register number
+ * and value, terminated by 0xff. Runs of consecutive registers are written
+ * in one SPI burst. */
+static const uint8_t PROGMEM initregs[] = {
   /* RegOpMode -> standby. */
-  rfm69_writereg(0x01, 0x00 | 0x04);
+  0x01, 0x00 | 0x04,
   /* RegDataModul -> PacketMode, FSK, Shaping 0 */
-  rfm69_writereg(0x02, 0x00);
-  /* RegFDevMsb / RegFDevLsb -> 0x05C3 (90 kHz). */
-  rfm69_writereg(0x05, 0x05);
-  rfm69_writereg(0x06, 0xC3);
+  0x02, 0x00,
+  /* RegBitrate and RegFdev come from the profile */
+  /* RegFrfMsb / Mid / Lsb */
+  0x07, (RFM_FREQREG >> 16) & 0xff,
+  0x08, (RFM_FREQREG >>  8) & 0xff,
+  0x09, (RFM_FREQREG >>  0) & 0xff,
   /* RegPaLevel -> Pa0=0 Pa1=1 Pa2=0 Outputpower=31 -> 13 dbM */
-  rfm69_writereg(0x11, 0x5F);
+  0x11, 0x5F,
   /* RegPaRamp -> 0x0c = 20us   default = 0x09 = 40us */
-  /* rfm69_writereg(0x12, 0x0c); */
+  /* 0x12, 0x0c, */
   /* RegOcp -> defaults (jeelink-sketch sets 0 but that seems wrong) */
-  rfm69_writereg(0x13, 0x1a);
-  /* RegRxBw -> DccFreq 010   Mant 16   Exp 2 - this is a receiver-register,
-   * we do not really care about it */
-  rfm69_writereg(0x19, 0x42);
+  0x13, 0x1a,
+  /* RegRxBw / RegAfcBw come from the profile */
+  /* RegDioMapping1 -> DIO0 = 00, which is PacketSent in TX mode */
+  0x25, 0x00,
   /* RegDioMapping2 -> disable clkout (but thats the default anyways) */
-  rfm69_writereg(0x26, 0x07);
-  /* RegIrqFlags2 (0x28): some status flags, writing a 1 to FIFOOVERRUN bit
-   * clears the FIFO. This is what clearfifo() does. */
-  rfm69_clearfifo();
+  0x26, 0x07,
   /* RegRssiThresh -> 220 */
-  rfm69_writereg(0x29, 220);
-  /* RegPreambleMsb / Lsb - we want 3 bytes of preamble (0xAA) */
-  rfm69_writereg(0x2C, 0x00);
-  rfm69_writereg(0x2D, 0x03);
+  0x29, 220,
+  /* RegPreambleMsb - the number of preamble bytes (0xAA) is in the
+   * profile, and never more than 255 */
+  0x2C, 0x00,
   /* RegSyncConfig -> SyncOn FiFoFillAuto SyncSize=2 SyncTol=0 */
-  rfm69_writereg(0x2E, 0x88);
+  0x2E, 0x88,
   /* RegSyncValue1/2 (3-8 exist too but we only use 2 so do not need to set them) */
-  rfm69_writereg(0x2F, 0x2D);
-  rfm69_writereg(0x30, 0xD4);
+  0x2F, 0x2D,
+  0x30, 0xD4,
+#if defined(HWPACKET)
+  /* RegPacketConfig1 -> VariableLength CrcOn=1 CrcAutoClearOff=0
+   * AddressFiltering=node or broadcast address */
+  0x37, 0x94,
+  /* RegPayloadLength -> in variable length mode, the longest packet we
+   * accept */
+  0x38, PAYLOADSIZE,
+  /* RegNodeAdrs -> our sensor ID, see rfm69_setaddress()
+   * RegBroadcastAdrs -> 0xff */
+  0x39, 0x00,
+  0x3A, 0xff,
+#else /* HWPACKET */
   /* RegPacketConfig1 -> FixedPacketLength CrcOn=0 */
-  rfm69_writereg(0x37, 0x00);
-  /* RegPayloadLength -> 0
+  0x37, 0x00,
+  /* RegPayloadLength
    * This selects between two different modes: "0" means "Unlimited length
    * packet format", any other value "Fixed Length Packet Format" (with that
-   * length). We set 0 for now, but actually fill the register before sending.
-   */
-  rfm69_writereg(0x38, 0x0c);
+   * length). We actually fill the register before sending. */
+  0x38, 0x0c,
+#endif /* HWPACKET */
   /* RegFifoThreshold -> TxStartCond=1 value=0x0f */
-  rfm69_writereg(0x3C, 0x8F);
+  0x3C, 0x8F,
   /* RegPacketConfig2 -> AesOn=0 and AutoRxRestart=1 even if we do not care about RX */
-  rfm69_writereg(0x3D, 0x12);
+  0x3D, 0x12,
   /* RegTestDagc -> improvedlowbeta0 - I haven't got the faintest... */
-  /* rfm69_writereg(0x6F, 0x30); */
-  /* Set Frequency */
-  /* The datasheet is horrible to read at that point, never stating a clear
-   * formula ready for use. */
-  /* F(Step) = F(XOSC) / (2 ** 19)      2 ** 19 = 524288
-   * F(forreg) = FREQUENCY_IN_HZ / F(Step) */
-  uint32_t freq = round((1000.0 * RFM_FREQUENCY) / (32000000.0 / 524288.0));
-  /* (Alternative calculation from JeeNode library:)
-   * Frequency steps are in units of (32,000,000 >> 19) = 61.03515625 Hz
-   * use multiples of 64 to avoid multi-precision arithmetic, i.e. 3906.25 Hz
-   * due to this, the lower 6 bits of the calculated factor will always be 0
-   * this is still 4 ppm, i.e. well below the radio's 32 MHz crystal accuracy */
-  /* uint32_t freq = (((RFM_FREQUENCY * 1000) << 2) / (32000000UL >> 11)) << 6; */
-  rfm69_writereg(0x07, (freq >> 16) & 0xff);
-  rfm69_writereg(0x08, (freq >>  8) & 0xff);
-  rfm69_writereg(0x09, (freq >>  0) & 0xff);
-  /* Set Datarate - the whole floating point mess seems to be optimized out 
-   * by gcc at compile time, thank god. */
-  uint16_t dr = (uint16_t)round(32000000.0 / RFM_DATARATE);
-  rfm69_writereg(0x03, (dr >> 8));
-  rfm69_writereg(0x04, (dr & 0xff));
+  /* 0x6F, 0x30, */
+  0xff
+};
 
+void rfm69_initchip(void) {
+  const uint8_t * p = initregs;
+  uint8_t reg = pgm_read_byte(p);
+  while (reg != 0xff) {
+    /* Start a burst: the RFM69 automatically increments the register
+     * address after each byte. */
+    rfm69_select();
+    rfm69_spi8(reg | 0x80);
+    do {
+      rfm69_spi8(pgm_read_byte(p + 1));
+      p += 2;
+    } while (pgm_read_byte(p) == ++reg);
+    rfm69_deselect();
+    reg = pgm_read_byte(p);
+  }
+  opmode = 0x04;
+  rfm69_setprofile(0);
+  /* RegIrqFlags2 (0x28): some status flags, writing a 1 to FIFOOVERRUN bit
+   * clears the FIFO. This is what clearfifo() does. */
   rfm69_clearfifo();
 }
+
+#if defined(HWPACKET)
+void rfm69_setaddress(uint8_t addr) {
+  rfm69_writereg(0x39, addr); /* RegNodeAdrs */
+}
+#endif /* HWPACKET */
+
+void rfm69_setprofile(uint8_t p) {
+  struct rfm69profile pr;
+  if (p >= RFM69_NUMPROFILES) {
+    p = 0;
+  }
+  memcpy_P(&pr, &profiles[p], sizeof(pr));
+  rfm69_select();
+  rfm69_spi8(0x03 | 0x80); /* Burst RegBitrateMsb - RegFdevLsb */
+  rfm69_spi8(pr.bitrate[0]);
+  rfm69_spi8(pr.bitrate[1]);
+  rfm69_spi8(pr.fdev[0]);
+  rfm69_spi8(pr.fdev[1]);
+  rfm69_deselect();
+  rfm69_writereg(0x19, pr.rxbw);
+  rfm69_writereg(0x1A, pr.afcbw);
+  rfm69_writereg(0x2D, pr.preamble);
+  bytetimeus = pr.bytetimeus;
+  preamblelen = pr.preamble;
+}
@@ -9,10 +9,66 @@
  * and it also resets the RFM! */
 void rfm69_initport(void);
 void rfm69_initchip(void);
+/* Select a radio profile, i.e. data rate, frequency deviation, receiver
+ * bandwidth and preamble length (see rfm69.c). rfm69_initchip() selects
+ * profile 0, the one compatible with the Jeelink. */
+#define RFM69_NUMPROFILES 4
+void rfm69_setprofile(uint8_t p);
+#if defined(HWPACKET)
+/* Set the address packets to us must be sent to (we also accept 0xff).
+ * Only receiving is filtered, what we send has no address byte. */
+void rfm69_setaddress(uint8_t addr);
+#endif /* HWPACKET */
 void rfm69_clearfifo(void);
 void rfm69_settransmitter(uint8_t e);
 void rfm69_sendarray(uint8_t * data, uint8_t length);
 void rfm69_setsleep(uint8_t s);
 uint8_t rfm69_readreg(uint8_t reg);
 
+#if defined(LISTENBEFORETALK)
+/* Carrier sense: Briefly switches to RX, samples the RSSI a few times and
+ * returns 1 if all samples were weaker than 'thresh', i.e. nobody else
+ * seems to be sending. 'thresh' is in the raw unit of RegRssiValue, that is
+ * -2 * dBm (so 180 means -90 dBm). The radio must be in standby, and is
+ * back in standby afterwards. If the radio does not become ready or does
+ * not finish a measurement within a few milliseconds, this returns 1
+ * without looking at any samples. */
+uint8_t rfm69_channelfree(uint8_t thresh);
+#endif /* LISTENBEFORETALK */
+
+#if defined(ACKEDUPLINK) || defined(DOWNLINKCONFIG)
+/* Set the transmit power, in dBm. We only use PA1, so this must be from
+ * -2 to +13 dBm. */
+#define RFM69_MINDBM (-2)
+#define RFM69_MAXDBM 13
+void rfm69_setpower(int8_t dbm);
+#endif /* ACKEDUPLINK || DOWNLINKCONFIG */
+
+/* Receiving is only needed for some options */
+#if defined(TDMA) || defined(ACKEDUPLINK) || defined(DOWNLINKCONFIG)
+#define RFM69_RX
+#endif
+
+#if defined(RFM69_RX)
+/* Receiving. rfm69_startrx() switches to RX, waiting for a packet of
+ * exactly 'len' bytes. With HWPACKET, that is 'len' bytes after the length
+ * and address bytes, and the radio checks the address and CRC16. The
+ * radio must be in standby. Once rfm69_rxdone() returns 1, the packet can
+ * be fetched with rfm69_readfifo(), which returns 0 if it does not have
+ * the right length. rfm69_stoprx() goes back to standby. */
+void rfm69_startrx(uint8_t len);
+/* Returns 1 if a packet has arrived, and when (timers_getcounts() at the
+ * PayloadReady IRQ, i.e. right after its last byte) in *ts. */
+uint8_t rfm69_rxdone(uint32_t * ts);
+uint8_t rfm69_readfifo(uint8_t * buf, uint8_t len);
+void rfm69_stoprx(void);
+/* Are we receiving? Then TIMER1 must keep running for the timestamps, so
+ * no power-down sleep. Call with interrupts disabled. */
+uint8_t rfm69_isrxactive_noirq(void);
+/* Wait (sleeping) up to 'timeoutms' for a packet of exactly 'len' bytes and
+ * read it into buf. Returns 1 if one arrived. The radio must be in
+ * standby, and is back in standby afterwards. */
+uint8_t rfm69_receive(uint8_t * buf, uint8_t len, uint16_t timeoutms);
+#endif /* RFM69_RX */
+
 #endif /* _RFM69_H_ */
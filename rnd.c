@@ -0,0 +1,45 @@
+/* $Id: rnd.c $
+ * A small pseudo random number generator, for randomizing when we send.
+ *
+ * This is a 16 bit Galois LFSR with the maximum period of 65535. That is
+ * nowhere near good enough for anything security related, but plenty for
+ * making sure two sensors do not keep picking the same transmit time.
+ */
+
+#include <avr/io.h>
+#include "rnd.h"
+
+/* Must never become 0, the LFSR would stay there forever. */
+static uint16_t lfsr = 0xACE1;
+
+static void step(uint8_t n)
+{
+  while (n--) {
+    uint8_t lsb = lfsr & 1;
+    lfsr >>= 1;
+    if (lsb) {
+      lfsr ^= 0xB400; /* Taps 16, 14, 13, 11 */
+    }
+  }
+}
+
+void rnd_addentropy(uint16_t e)
+{
+  lfsr ^= e;
+  if (lfsr == 0) {
+    lfsr = 0xACE1;
+  }
+  step(3);
+}
+
+uint8_t rnd_get8(void)
+{
+  step(8);
+  return lfsr & 0xff;
+}
+
+uint16_t rnd_get16(void)
+{
+  step(16);
+  return lfsr;
+}
@@ -0,0 +1,16 @@
+/* $Id: rnd.h $
+ * A small pseudo random number generator, for randomizing when we send.
+ */
+
+#ifndef _RND_H_
+#define _RND_H_
+
+/* Mix something that is different on every sensor or every call (sensor ID,
+ * noisy low bits of measurements, timer values) into the state. */
+void rnd_addentropy(uint16_t e);
+
+/* Get 8 or 16 random bits */
+uint8_t rnd_get8(void);
+uint16_t rnd_get16(void);
+
+#endif /* _RND_H_ */
@@ -9,49 +9,93 @@
 #include <avr/pgmspace.h>
 #include <util/delay.h>
 #include "sds011.h"
+#include "sds011parse.h"
 #include "console.h"
+#include "energy.h"
+#include "irqstats.h"
+#include "timers.h"
 
-/* Buffers for input and output */
-#define INPUTBUFSIZE 11  /* The SDS011 uses fixed size packets of 19 or 10 Bytes */
-static uint8_t inputbuf[INPUTBUFSIZE];
-static uint8_t inputpos = 0;
+/* Buffers for input and output.
+ * The RX ISR only puts the received bytes into rxbuf, they are parsed by
+ * sds011_work() in the main loop. The ISR is the only one writing rxhead,
+ * sds011_work() the only one writing rxtail, so neither side needs to
+ * disable interrupts for that. */
+#define RXBUFSIZE 32     /* Must be a power of 2 */
+static volatile uint8_t rxbuf[RXBUFSIZE];
+static volatile uint8_t rxhead = 0;
+static volatile uint8_t rxtail = 0;
+static volatile uint8_t rxoverruns = 0; /* Bytes lost because rxbuf was full */
+static uint8_t rxoverrunsreported = 0;
+static struct sds011parser parser;
 #define OUTPUTBUFSIZE 60 /* Enough to buffer 3 commands, that should be plenty. */
 static uint8_t outputbuf[OUTPUTBUFSIZE];
 static uint8_t outputhead = 0;
 static uint8_t outputtail = 0;
 static uint8_t opinprog = 0;
 
+/* Commands for the sensor. Every command gets a reply from the sensor,
+ * echoing what it was told, so we only send the next command once the
+ * current one was confirmed, and resend it if no (matching) reply arrives
+ * in time. We need to stay awake (with the USART running) meanwhile. */
+struct sds011cmd {
+  uint8_t id;
+  uint8_t set;  /* 1 = set, 0 = query */
+  uint8_t val;
+};
+#define CMDQUEUELEN 6
+static struct sds011cmd cmdqueue[CMDQUEUELEN];
+static uint8_t cmdqhead = 0;
+static uint8_t cmdqlen = 0;   /* cmdqueue[cmdqhead] is in progress if > 0 */
+static uint8_t cmdtries = 0;  /* How often we sent that one already */
+static uint8_t cmdjob;        /* Timeout for the reply */
+static struct sds011cmdstats cmdstats;
+/* What we want the sensor to do. If it still sends readings while it
+ * should be sleeping, it missed the command. */
+static uint8_t wantworking = 0;
+
+#if defined(SDS011WORKINGPERIOD)
+#if (SDS011WORKINGPERIOD < 1) || (SDS011WORKINGPERIOD > 30)
+#error "SDS011WORKINGPERIOD must be between 1 and 30 (minutes)"
+#endif
+/* The sensor measures on its own and pushes one reading per period. We
+ * keep the USART running from SDS011PERIODMARGINMS before the next reading
+ * is due until it arrived, or until SDS011PERIODMARGINMS after it was due. */
+#define PERIODMS ((uint32_t)SDS011WORKINGPERIOD * 60000UL)
+/* How long the sensor measures in each period. We do not see when it
+ * turns its fan on, so for the energy accounting each reading counts as
+ * this much on-time. */
+#define PERIODONMS 30000UL
+static uint8_t listening = 0;
+static uint8_t windowjob;
+static uint8_t newresult = 0;
+static uint8_t periodfixes = 0; /* How often we tried to set it again */
+/* Set if the sensor woke us from power-down, i.e. it sent something while
+ * we did not listen. */
+static volatile uint8_t rxwakeup = 0;
+#endif /* SDS011WORKINGPERIOD */
+
 /* Formula for calculating the value of UBRR from baudrate and cpufreq */
 #define BAUDRATE 9600UL
 #define UBRRCALC ((CPUFREQ / (16UL * BAUDRATE)) - 1)
 
-/* Some commands for the SDS011. Only the relevant part, the first 4 bytes -
- * the rest is the same for all commands anyways (except the CRC which we calc) */
-/* Set data reporting to "only when queried" instead of the default "every second" */
-static const uint8_t PROGMEM cmd_setdatareporting[] = { 0xB4, 0x02, 0x01, 0x01 };
-/* Request the last measured data */
-static const uint8_t PROGMEM cmd_requestdata[] = { 0xB4, 0x04, 0x00, 0x00 };
-/* Turn measurements on */
-static const uint8_t PROGMEM cmd_sensoron[] = { 0xB4, 0x06, 0x01, 0x01 };
-/* Turn measurements off */
-static const uint8_t PROGMEM cmd_sensoroff[] = { 0xB4, 0x06, 0x01, 0x00 };
-
 /* where we store the values received from the sensor */
 static uint16_t pm2_5 = 0xffff; /* 0xffff = "invalid" */
 static uint16_t pm10 = 0xffff;
+/* When we received those (timers_getms()) */
+static uint32_t pmts = 0;
 
-/* Calculate the CRC of a packet.
- * You need to give this the address of the first byte that will be used
- * in the CRC, which is byte 2 (header, tail, and command ID do not go into
- * the CRC). */
-static uint8_t calcsds011crc(uint8_t * packet, uint8_t len)
-{
-  uint8_t res = 0;
-  for (uint8_t i = 0; i < len; i++) {
-    res += packet[i];
-  }
-  return res;
-}
+/* Aggregation of all readings over one measurement window. The sensor
+ * sends one reading per second while it is on, so this is plenty for the
+ * on-times we use. Readings beyond that are still added to min/max/mean. */
+#define MAXSAMPLES 40
+static uint16_t samples2_5[MAXSAMPLES];
+static uint16_t samples10[MAXSAMPLES];
+static uint8_t collecting = 0;
+static uint8_t converged = 0;
+static uint32_t collectstart;  /* timers_getms() when we turned the sensor on */
+static uint32_t sum2_5, sum10;
+static struct sds011stats cursum; /* median not yet valid */
+static struct sds011stats laststats;
 
 /* This can only be called safely with interrupts disabled! */
 static void appendchar(uint8_t what)
@@ -76,41 +120,343 @@ static void appendchar(uint8_t what)
   }
 }
 
-static void sendsds011cmd(PGM_P what)
+/* Sends the command at the head of the queue (again) */
+static void sendcurcmd(void)
+{
+  struct sds011cmd * c = &cmdqueue[cmdqhead];
+  uint8_t buf[SDS011CMDLEN];
+  uint8_t sreg = SREG;
+  sds011parse_buildcmd(buf, c->id, c->set, c->val);
+  cli();
+  for (uint8_t i = 0; i < SDS011CMDLEN; i++) {
+    appendchar(buf[i]);
+  }
+  SREG = sreg;
+  cmdtries++;
+  cmdstats.sent++;
+  timers_setjob(cmdjob, TIMERS_MS(SDS011CMDTIMEOUTMS));
+}
+
+/* The current command is done (confirmed or failed), go on with the next */
+static void nextcmd(void)
+{
+  timers_stopjob(cmdjob);
+  cmdqhead = (cmdqhead + 1) % CMDQUEUELEN;
+  cmdqlen--;
+  cmdtries = 0;
+  if (cmdqlen > 0) {
+    sendcurcmd();
+  }
+}
+
+static void queuecmd(uint8_t id, uint8_t set, uint8_t val)
+{
+  struct sds011cmd * c;
+  if (cmdqlen >= CMDQUEUELEN) { /* Should not happen, we send few commands */
+    cmdstats.failed++;
+    return;
+  }
+  c = &cmdqueue[(cmdqhead + cmdqlen) % CMDQUEUELEN];
+  c->id = id;
+  c->set = set;
+  c->val = val;
+  cmdqlen++;
+  if (cmdqlen == 1) { /* Nothing in progress, send it right away */
+    sendcurcmd();
+  }
+}
+
+/* Job: The reply to the current command did not arrive in time */
+static void cmdtimeoutjobfunc(void)
+{
+  if (cmdqlen == 0) { return; }
+  if (cmdtries <= SDS011CMDRETRIES) {
+    cmdstats.retries++;
+    sendcurcmd();
+  } else {
+    cmdstats.failed++;
+    console_printpgm_P(PSTR("!SDSCMDFAIL!"));
+    nextcmd();
+  }
+}
+
+/* Handle a reply (0xC5 packet) from the sensor */
+static void processreply(void)
+{
+  struct sds011cmd * c = &cmdqueue[cmdqhead];
+  if ((cmdqlen == 0) || (parser.buf[2] != c->id) || (parser.buf[3] != c->set)
+   || ((c->set) && (parser.buf[4] != c->val))) {
+    /* Not what we asked for. The timeout will resend our command. */
+    cmdstats.replymismatches++;
+    return;
+  }
+  switch (c->id) {
+  case SDS011CMD_REPORTMODE:
+    cmdstats.reportmode = parser.buf[4];
+    break;
+  case SDS011CMD_WORKSTATE:
+    cmdstats.working = parser.buf[4];
+    break;
+  case SDS011CMD_WORKPERIOD:
+    cmdstats.workperiod = parser.buf[4];
+    break;
+  };
+  cmdstats.confirmed++;
+#if defined(SDS011WORKINGPERIOD)
+  /* The setting is stored in the sensor's flash. Reading it back after
+   * setting it tells us whether that worked. */
+  if ((c->id == SDS011CMD_WORKPERIOD) && (!c->set)
+   && (parser.buf[4] != SDS011WORKINGPERIOD)) {
+    console_printpgm_P(PSTR("!SDSPERIOD!"));
+    cmdstats.statemismatches++;
+    if (periodfixes < SDS011CMDRETRIES) {
+      periodfixes++;
+      queuecmd(SDS011CMD_WORKPERIOD, 1, SDS011WORKINGPERIOD);
+      queuecmd(SDS011CMD_WORKPERIOD, 0, 0);
+    }
+  }
+#endif /* SDS011WORKINGPERIOD */
+  nextcmd();
+}
+
+#if defined(SDS011WORKINGPERIOD)
+/* Job: Start or end of the time window in which we expect a reading */
+static void windowjobfunc(void)
+{
+  if (!listening) {
+    listening = 1;
+    timers_setjob(windowjob, TIMERS_MS(2 * SDS011PERIODMARGINMS));
+  } else { /* Nothing arrived, try again one period later */
+    listening = 0;
+    cmdstats.missedreadings++;
+    timers_setjob(windowjob, TIMERS_MS(PERIODMS - 2 * SDS011PERIODMARGINMS));
+  }
+}
+
+/* The sensor (re)starts its cycle. We do not know when the first reading
+ * comes, only that it should be within one period. */
+static void startwindow(void)
+{
+  listening = 1;
+  timers_setjob(windowjob, TIMERS_MS(PERIODMS + SDS011PERIODMARGINMS));
+}
+
+/* The sensor is sleeping, there is nothing to wait for */
+static void stopwindow(void)
+{
+  listening = 0;
+  timers_stopjob(windowjob);
+}
+
+/* The next reading is due one period from now */
+static void syncwindow(void)
+{
+  listening = 0;
+  timers_setjob(windowjob, TIMERS_MS(PERIODMS - SDS011PERIODMARGINMS));
+}
+
+/* The sensor pushed the result of its measurement, that is our result */
+static void periodresult(uint16_t v2_5, uint16_t v10)
+{
+  laststats.ontimems = PERIODONMS; /* The sensor always measures for 30 s */
+  energy_add(ENERGY_SDS011, PERIODONMS);
+  laststats.converged = 0;
+  laststats.num = 1;
+  laststats.pm2_5.min = laststats.pm2_5.max = v2_5;
+  laststats.pm2_5.mean = laststats.pm2_5.median = v2_5;
+  laststats.pm10.min = laststats.pm10.max = v10;
+  laststats.pm10.mean = laststats.pm10.median = v10;
+  cli();
+  pm2_5 = v2_5;
+  pm10 = v10;
+  pmts = timers_getms();
+  sei();
+  newresult = 1;
+  syncwindow();
+}
+#endif /* SDS011WORKINGPERIOD */
+
+static void addsample(uint16_t v2_5, uint16_t v10)
+{
+  if (cursum.num == 0xff) { return; }
+  if (cursum.num < MAXSAMPLES) {
+    samples2_5[cursum.num] = v2_5;
+    samples10[cursum.num] = v10;
+  }
+  if (cursum.num == 0) {
+    cursum.pm2_5.min = cursum.pm2_5.max = v2_5;
+    cursum.pm10.min = cursum.pm10.max = v10;
+  } else {
+    if (v2_5 < cursum.pm2_5.min) { cursum.pm2_5.min = v2_5; }
+    if (v2_5 > cursum.pm2_5.max) { cursum.pm2_5.max = v2_5; }
+    if (v10 < cursum.pm10.min) { cursum.pm10.min = v10; }
+    if (v10 > cursum.pm10.max) { cursum.pm10.max = v10; }
+  }
+  sum2_5 += v2_5;
+  sum10 += v10;
+  cursum.num++;
+}
+
+/* Checks if the last SDS011STABLEREADINGS samples are within the
+ * tolerance of each other. */
+static uint8_t isstable(uint16_t * s)
+{
+  uint16_t mi = 0xffff; uint16_t ma = 0;
+  uint16_t tol;
+  for (uint8_t i = cursum.num - SDS011STABLEREADINGS; i < cursum.num; i++) {
+    if (s[i] < mi) { mi = s[i]; }
+    if (s[i] > ma) { ma = s[i]; }
+  }
+  tol = (uint16_t)(((uint32_t)ma * SDS011STABLEPCT) / 100);
+  if (tol < SDS011STABLEABS) { tol = SDS011STABLEABS; }
+  return ((ma - mi) <= tol);
+}
+
+static void checkconverged(void)
+{
+  if ((cursum.num < SDS011STABLEREADINGS) || (cursum.num > MAXSAMPLES)) {
+    return;
+  }
+  if ((timers_getms() - collectstart) < SDS011MINONMS) {
+    return;
+  }
+  if (isstable(samples2_5) && isstable(samples10)) {
+    converged = 1;
+  }
+}
+
+#if !defined(SDS011WORKINGPERIOD)
+/* Sorts the first n samples (insertion sort, n is small) and returns the
+ * median. For an even number of samples, that is the mean of the middle two. */
+static uint16_t median(uint16_t * s, uint8_t n)
 {
-  uint8_t crc = 0; uint8_t c;
-  appendchar(0xAA);
-  for (uint8_t i = 0; i < 4; i++) {
-    c = pgm_read_byte(what);
-    appendchar(c);
-    what++;
-    if (i != 0) { /* the 0xB4 is not added to the CRC! */
-      crc += c;
+  for (uint8_t i = 1; i < n; i++) {
+    uint16_t v = s[i];
+    uint8_t j = i;
+    while ((j > 0) && (s[j - 1] > v)) {
+      s[j] = s[j - 1];
+      j--;
     }
+    s[j] = v;
+  }
+  if (n & 1) {
+    return s[n / 2];
+  }
+  return (uint16_t)(((uint32_t)s[n / 2 - 1] + s[n / 2] + 1) / 2);
+}
+
+/* The measurement window has ended, calculate the aggregate and make it
+ * our result. The samples are only ever touched from the main loop, so
+ * sorting them does not need interrupts disabled, only publishing the
+ * result does. */
+static void finishcollecting(void)
+{
+  uint8_t n;
+  collecting = 0;
+  cursum.ontimems = timers_getms() - collectstart;
+  cursum.converged = converged;
+  if (cursum.num == 0) { /* Nothing received after the warmup */
+    cli();
+    pm2_5 = 0xffff;
+    pm10 = 0xffff;
+    laststats = cursum;
+    sei();
+    return;
   }
-  for (uint8_t i = 0; i < 10; i++) {
-    appendchar(0x00);
-    /* The 0 doesn't add anything to the CRC */
+  n = (cursum.num > MAXSAMPLES) ? MAXSAMPLES : cursum.num;
+  /* Means are rounded, in the same 1/10 ug/m^3 the sensor uses */
+  cursum.pm2_5.mean = (sum2_5 + (cursum.num / 2)) / cursum.num;
+  cursum.pm10.mean = (sum10 + (cursum.num / 2)) / cursum.num;
+  cursum.pm2_5.median = median(samples2_5, n);
+  cursum.pm10.median = median(samples10, n);
+  cli();
+  laststats = cursum;
+  pm2_5 = cursum.pm2_5.median;
+  pm10 = cursum.pm10.median;
+  pmts = timers_getms();
+  sei();
+}
+#endif /* !SDS011WORKINGPERIOD */
+
+/* Handle a complete, valid packet from the parser */
+static void processsdspacket(void)
+{
+  if (parser.buf[1] == SDS011PKT_DATA) { /* Sensor data */
+    uint16_t v2_5, v10;
+    sds011parse_getpm(&parser, &v2_5, &v10);
+    /* Readings from while the fan is still spinning up are not reliable */
+    if ((collecting) && ((timers_getms() - collectstart) >= SDS011WARMUPMS)) {
+      addsample(v2_5, v10);
+      checkconverged();
+    }
+#if defined(SDS011WORKINGPERIOD)
+    if (wantworking) {
+      periodresult(v2_5, v10);
+    }
+#endif /* SDS011WORKINGPERIOD */
+    /* Only a working sensor sends readings */
+    cmdstats.working = 1;
+    if ((!wantworking) && (cmdqlen == 0)) {
+      /* It should be sleeping, so it missed our command. */
+      cmdstats.statemismatches++;
+      queuecmd(SDS011CMD_WORKSTATE, 1, 0);
+    }
+  } else if (parser.buf[1] == SDS011PKT_REPLY) { /* Reply to a command */
+    processreply();
   }
-  appendchar(0xff);
-  crc += 0xff;
-  appendchar(0xff);
-  crc += 0xff;
-  appendchar(crc);
-  appendchar(0xAB);
 }
 
-static void processsdsdata(void)
+void sds011_work(void)
 {
-  if (inputbuf[1] == 0xC0) { /* Sensor data */
-    pm2_5 = ((uint16_t)inputbuf[3] << 8) | inputbuf[2];
-    pm10 = ((uint16_t)inputbuf[5] << 8) | inputbuf[4];
+#if defined(SDS011WORKINGPERIOD)
+  if (rxwakeup) {
+    /* That reading is lost, but now we know when the next one comes. */
+    rxwakeup = 0;
+    if (wantworking) {
+      cmdstats.resyncs++;
+      syncwindow();
+    }
   }
+#endif /* SDS011WORKINGPERIOD */
+  while (rxtail != rxhead) {
+    uint8_t inpb = rxbuf[rxtail];
+    rxtail = (rxtail + 1) & (RXBUFSIZE - 1);
+    /* console_printpgm_P(PSTR(" R"));
+    console_printhex8(inpb); */
+    switch (sds011parse_byte(&parser, inpb)) {
+    case SDS011PARSE_PACKET:
+      processsdspacket();
+      break;
+    case SDS011PARSE_CRCERR:
+      console_printpgm_P(PSTR("!SDSCRC!"));
+      break;
+    case SDS011PARSE_FRAMEERR:
+      console_printpgm_P(PSTR("!SDSOVFL!"));
+      break;
+    };
+  }
+  if (rxoverruns != rxoverrunsreported) {
+    rxoverrunsreported = rxoverruns;
+    console_printpgm_P(PSTR("!SDSRXOVR!"));
+  }
+}
+
+/* External interrupt on our RX pin. This is only enabled while we are in
+ * power-down sleep, where the USART does not work, so that the SDS011
+ * starting to talk wakes us up. Whatever it sent is lost of course, that is
+ * why we only go to power-down while we do not expect anything from it. */
+ISR(INT2_vect)
+{
+  EIMSK &= (uint8_t)~_BV(INT2);
+#if defined(SDS011WORKINGPERIOD)
+  rxwakeup = 1;
+#endif /* SDS011WORKINGPERIOD */
 }
 
 /* Handler for TXC (TX Complete) IRQ */
 ISR(USART1_TX_vect)
 {
+  IRQSTATS_ISRSTART();
   if (outputhead == outputtail) { /* Nothing more to send! */
     opinprog = 0;
   } else {
@@ -120,58 +466,82 @@ ISR(USART1_TX_vect)
       outputhead = 0;
     }
   }
+  IRQSTATS_ISREND(IRQSTAT_USART1TX);
 }
 
-/* Handler for RXC (RX Complete) IRQ. */
+/* Handler for RXC (RX Complete) IRQ. Only queues the byte. */
 ISR(USART1_RX_vect)
 {
+  IRQSTATS_ISRSTART();
   uint8_t inpb;
+  uint8_t newhead;
 
   inpb = UDR1;
-  /* console_printpgm_noirq_P(PSTR(" R"));
-  console_printhex8_noirq(inpb); */
-  if (inputpos > 0) { /* Has a packet already started? */
-    inputbuf[inputpos] = inpb;
-    inputpos++;
-    if (inputpos == 10) { /* This should be the end of the packet */
-      if (inpb == 0xAB) { /* Looking good */
-        uint8_t crc = calcsds011crc(&inputbuf[2], 6);
-        /* check "CRC" */
-        if (crc == inputbuf[8]) {
-          processsdsdata();
-        } else {
-          /* invalid packet */
-          console_printpgm_noirq_P(PSTR("!SDSCRC!"));
-        }
-      } else {
-        console_printpgm_noirq_P(PSTR("!SDSOVFL!"));
-      }
-      inputpos = 0; /* Start over */
-    }
-  } else { /* Check if a new packet started */
-    if (inpb == 0xAA) { /* This marks the start of a packet */
-      inputbuf[inputpos] = inpb;
-      inputpos++;
-    }
+  newhead = (rxhead + 1) & (RXBUFSIZE - 1);
+  if (newhead != rxtail) {
+    rxbuf[rxhead] = inpb;
+    rxhead = newhead;
+  } else {
+    rxoverruns++;
   }
+  IRQSTATS_ISREND(IRQSTAT_USART1RX);
 }
 
-void sds011_requestresult(void)
+#if defined(SDS011WORKINGPERIOD)
+void sds011_setmeasurements(uint8_t ooo)
 {
-  cli();
-  sendsds011cmd(cmd_requestdata);
-  sei();
+  /* The sensor runs its own cycle, we only let it or stop it. */
+  if (ooo != wantworking) {
+    wantworking = ooo;
+    queuecmd(SDS011CMD_WORKSTATE, 1, ooo);
+    if (ooo) {
+      startwindow();
+    } else {
+      stopwindow();
+    }
+  }
 }
 
+uint8_t sds011_hasnewresult(void)
+{
+  uint8_t res = newresult;
+  newresult = 0;
+  return res;
+}
+#else /* SDS011WORKINGPERIOD */
 void sds011_setmeasurements(uint8_t ooo)
 {
-  cli();
+  wantworking = ooo;
+  queuecmd(SDS011CMD_WORKSTATE, 1, ooo);
   if (ooo) {
-    sendsds011cmd(cmd_sensoron);
+    energy_on(ENERGY_SDS011);
+    cursum.num = 0;
+    sum2_5 = 0;
+    sum10 = 0;
+    collectstart = timers_getms();
+    converged = 0;
+    collecting = 1;
   } else {
-    sendsds011cmd(cmd_sensoroff);
+    energy_off(ENERGY_SDS011);
+    if (collecting) {
+      finishcollecting();
+    }
   }
+}
+#endif /* SDS011WORKINGPERIOD */
+
+void sds011_getstats_noirq(struct sds011stats * s)
+{
+  *s = laststats;
+}
+
+uint8_t sds011_hasconverged(void)
+{
+  uint8_t res;
+  cli();
+  res = ((collecting) && (converged));
   sei();
+  return res;
 }
 
 uint16_t sds011_getlastpm2_5(void)
@@ -192,6 +562,57 @@ uint16_t sds011_getlastpm10(void)
   return res;
 }
 
+uint8_t sds011_isbusy_noirq(void)
+{
+  if ((opinprog) || (parser.pos > 0) || (rxhead != rxtail)) {
+    return 1;
+  }
+  /* While measuring, the sensor sends a reading every second, and we want
+   * all of them. */
+  if (collecting) {
+    return 1;
+  }
+  /* Waiting for the reply to a command */
+  if (cmdqlen > 0) {
+    return 1;
+  }
+#if defined(SDS011WORKINGPERIOD)
+  /* The next reading is due */
+  if (listening) {
+    return 1;
+  }
+#endif /* SDS011WORKINGPERIOD */
+  return 0;
+}
+
+void sds011_setwakeup_noirq(uint8_t on)
+{
+  if (on) {
+    /* INT2 is on PD2, the same pin as our RXD1. Trigger on the falling edge
+     * of the start bit. */
+    EICRA = (EICRA & (uint8_t)~(_BV(ISC21) | _BV(ISC20))) | _BV(ISC21);
+    EIFR = _BV(INTF2); /* Clear stale flag */
+    EIMSK |= _BV(INT2);
+  } else {
+    EIMSK &= (uint8_t)~_BV(INT2);
+  }
+}
+
+uint8_t sds011_haspendingrx_noirq(void)
+{
+  return (rxhead != rxtail);
+}
+
+void sds011_getcmdstats_noirq(struct sds011cmdstats * s)
+{
+  *s = cmdstats;
+}
+
+uint32_t sds011_getlastpmts_noirq(void)
+{
+  return pmts;
+}
+
 void sds011_init(void)
 {
   /* Enable pullup on our RX pin, really weird sh*t can happen if that is
@@ -208,6 +629,29 @@ void sds011_init(void)
   UCSR1B = _BV(TXEN1) | _BV(RXEN1) | _BV(TXCIE1) | _BV(RXCIE1);
   /* No CTS / RTS (although this is the poweron default anyways) */
   UCSR1D = 0x00;
-  sendsds011cmd(cmd_setdatareporting);
-  sendsds011cmd(cmd_sensoroff);
+  sds011parse_init(&parser);
+  cmdstats.working = SDS011_UNKNOWN;
+  cmdstats.reportmode = SDS011_UNKNOWN;
+  cmdstats.workperiod = SDS011_UNKNOWN;
+  cmdjob = timers_addjob(cmdtimeoutjobfunc, 0, 0);
+  if (cmdjob == TIMERS_NOJOB) { /* TIMERS_MAXJOBS needs to be raised */
+    console_printpgm_P(PSTR("!SDSNOJOB!"));
+  }
+  timers_stopjob(cmdjob);
+  /* Set data reporting to "every second" (active mode). That is the
+   * default, but the setting is persistent, so we cannot rely on it. While
+   * the sensor is sleeping it does not report anything. */
+  queuecmd(SDS011CMD_REPORTMODE, 1, 0);
+#if defined(SDS011WORKINGPERIOD)
+  /* Let the sensor do its cycle on its own. The first reading should
+   * arrive within one period. */
+  windowjob = timers_addjob(windowjobfunc, 0, 0);
+  startwindow();
+  queuecmd(SDS011CMD_WORKPERIOD, 1, SDS011WORKINGPERIOD);
+  queuecmd(SDS011CMD_WORKPERIOD, 0, 0); /* Read it back to verify */
+  wantworking = 1;
+  queuecmd(SDS011CMD_WORKSTATE, 1, 1);
+#else /* SDS011WORKINGPERIOD */
+  queuecmd(SDS011CMD_WORKSTATE, 1, 0);
+#endif /* SDS011WORKINGPERIOD */
 }
@@ -8,14 +8,125 @@
 /* Initialize the sensor */
 void sds011_init(void);
 
-/* Turn measurements on or off. */
+/* Parse what the sensor sent us. The RX interrupt only queues the bytes,
+ * so this needs to be called regularly from the main loop. */
+void sds011_work(void);
+
+/* Readings from the first seconds after turning measurements on are
+ * ignored, because the fan needs some time to get a stable airflow. */
+#if !defined(SDS011WARMUPMS)
+#define SDS011WARMUPMS 10000
+#endif
+/* Once the readings have been stable for a while, more of them do not tell
+ * us anything new, so the measurement can end early to save power. Stable
+ * means the last SDS011STABLEREADINGS readings of both PM2.5 and PM10 are
+ * within SDS011STABLEABS (in 1/10 ug/m^3) or SDS011STABLEPCT percent of
+ * each other, whichever is larger. Never earlier than SDS011MINONMS after
+ * turning the sensor on. */
+#if !defined(SDS011STABLEREADINGS)
+#define SDS011STABLEREADINGS 5
+#endif
+#if !defined(SDS011STABLEABS)
+#define SDS011STABLEABS 10
+#endif
+#if !defined(SDS011STABLEPCT)
+#define SDS011STABLEPCT 10
+#endif
+#if !defined(SDS011MINONMS)
+#define SDS011MINONMS 15000
+#endif
+
+/* Every command we send to the sensor has to be confirmed by its reply
+ * within SDS011CMDTIMEOUTMS, else it is sent again, up to SDS011CMDRETRIES
+ * times. */
+#if !defined(SDS011CMDTIMEOUTMS)
+#define SDS011CMDTIMEOUTMS 500
+#endif
+#if !defined(SDS011CMDRETRIES)
+#define SDS011CMDRETRIES 3
+#endif
+
+#if defined(SDS011WORKINGPERIOD)
+/* In this mode, the sensor runs its own cycle: It wakes up every
+ * SDS011WORKINGPERIOD minutes (1 to 30), measures for 30 seconds and then
+ * sends one reading, which becomes our result. Because the USART does not
+ * work in power-down sleep, we stay in idle sleep from SDS011PERIODMARGINMS
+ * before the reading is due until it arrives. */
+#if !defined(SDS011PERIODMARGINMS)
+#define SDS011PERIODMARGINMS (2000UL + ((uint32_t)SDS011WORKINGPERIOD * 60000UL) / 16)
+#endif
+/* Let the sensor run its cycle (1) or keep it sleeping (0). */
+void sds011_setmeasurements(uint8_t ooo);
+/* Has the sensor sent a new result since the last call? */
+uint8_t sds011_hasnewresult(void);
+#else /* SDS011WORKINGPERIOD */
+/* Turn measurements on or off. While they are on, we collect all readings
+ * the sensor sends (except during the warmup time). Turning them off makes
+ * the median of those the new result. */
 void sds011_setmeasurements(uint8_t ooo);
+#endif /* SDS011WORKINGPERIOD */
 
-/* Request measurement results from sensor */
-void sds011_requestresult(void);
+/* Statistics over the readings of the last measurement window. All values
+ * are in 1/10 ug/m^3, like the sensor reports them. */
+struct sds011pmstats {
+  uint16_t min;
+  uint16_t max;
+  uint16_t mean;
+  uint16_t median;
+};
+struct sds011stats {
+  uint32_t ontimems; /* How long the sensor was on */
+  uint8_t converged; /* 1 if it was turned off early because of that */
+  uint8_t num; /* Number of readings, the pm values are invalid if 0 */
+  struct sds011pmstats pm2_5;
+  struct sds011pmstats pm10;
+};
+/* Fetch the statistics. Call with interrupts disabled. */
+void sds011_getstats_noirq(struct sds011stats * s);
+/* Have the readings of the current measurement become stable? Then it is
+ * time to turn measurements off. */
+uint8_t sds011_hasconverged(void);
 
-/* Fetch the data last received from the sensor */
+/* The state of the sensor, as far as it confirmed it, and how well
+ * talking to it works. */
+#define SDS011_UNKNOWN 0xff
+struct sds011cmdstats {
+  uint8_t working;      /* 1 = working, 0 = sleeping, or SDS011_UNKNOWN */
+  uint8_t reportmode;   /* 0 = active, 1 = query, or SDS011_UNKNOWN */
+  uint8_t workperiod;   /* Minutes, 0 = continuous, or SDS011_UNKNOWN */
+  uint16_t sent;        /* Commands sent, including retries */
+  uint16_t confirmed;   /* Commands the sensor confirmed */
+  uint16_t retries;     /* Commands sent again because of no reply */
+  uint16_t failed;      /* Commands given up on */
+  uint16_t replymismatches; /* Replies that did not match our command */
+  uint16_t statemismatches; /* Readings received while it should sleep,
+                             * or a working period that did not stick */
+#if defined(SDS011WORKINGPERIOD)
+  uint16_t missedreadings;  /* No reading when it was due */
+  uint16_t resyncs;         /* It woke us from power-down, reading lost */
+#endif /* SDS011WORKINGPERIOD */
+};
+/* Fetch those. Call with interrupts disabled. */
+void sds011_getcmdstats_noirq(struct sds011cmdstats * s);
+
+/* Fetch the result of the last measurement window (the median) */
 uint16_t sds011_getlastpm2_5(void);
 uint16_t sds011_getlastpm10(void);
+/* When the data was last received, as a timers_getms() timestamp.
+ * Call with interrupts disabled. */
+uint32_t sds011_getlastpmts_noirq(void);
+
+/* Are we currently talking to the sensor (sending a command, receiving,
+ * parsing, or waiting for a reply)? If yes, we must not stop the USART by going to
+ * power-down sleep. Call with interrupts disabled. */
+uint8_t sds011_isbusy_noirq(void);
+
+/* Are there received bytes that sds011_work() has not parsed yet? Then we
+ * should not sleep at all. Call with interrupts disabled. */
+uint8_t sds011_haspendingrx_noirq(void);
+
+/* Enable or disable the pin change wakeup on our RX pin, used while in
+ * power-down sleep. Call with interrupts disabled. */
+void sds011_setwakeup_noirq(uint8_t on);
 
 #endif /* _SDS011_H_ */
@@ -0,0 +1,67 @@
+/* $Id: sds011parse.c $
+ * Parser for the packets the SDS011 sends us. This is plain C without any
+ * AVR specific parts, so it can be tested on the host too.
+ */
+
+#include <stdint.h>
+#include "sds011parse.h"
+
+void sds011parse_init(struct sds011parser * p)
+{
+  p->pos = 0;
+}
+
+uint8_t sds011parse_crc(const uint8_t * data, uint8_t len)
+{
+  uint8_t res = 0;
+  for (uint8_t i = 0; i < len; i++) {
+    res += data[i];
+  }
+  return res;
+}
+
+uint8_t sds011parse_byte(struct sds011parser * p, uint8_t b)
+{
+  if (p->pos == 0) { /* Check if a new packet started */
+    if (b == 0xAA) {
+      p->buf[p->pos++] = b;
+    }
+    return SDS011PARSE_NONE;
+  }
+  p->buf[p->pos++] = b;
+  if (p->pos < SDS011PKTLEN) {
+    return SDS011PARSE_NONE;
+  }
+  p->pos = 0; /* Start over with the next byte, whatever happens now */
+  if (b != 0xAB) {
+    return SDS011PARSE_FRAMEERR;
+  }
+  /* Header, type, and tail do not go into the checksum */
+  if (sds011parse_crc(&p->buf[2], 6) != p->buf[8]) {
+    return SDS011PARSE_CRCERR;
+  }
+  return SDS011PARSE_PACKET;
+}
+
+void sds011parse_buildcmd(uint8_t * buf, uint8_t id, uint8_t set, uint8_t val)
+{
+  buf[0] = 0xAA;
+  buf[1] = 0xB4;
+  buf[2] = id;
+  buf[3] = set;
+  buf[4] = val;
+  for (uint8_t i = 5; i < 15; i++) {
+    buf[i] = 0x00;
+  }
+  buf[15] = 0xff; /* Device ID, 0xffff = any */
+  buf[16] = 0xff;
+  /* The 0xAA and 0xB4 do not go into the checksum */
+  buf[17] = sds011parse_crc(&buf[2], 15);
+  buf[18] = 0xAB;
+}
+
+void sds011parse_getpm(const struct sds011parser * p, uint16_t * pm2_5, uint16_t * pm10)
+{
+  *pm2_5 = ((uint16_t)p->buf[3] << 8) | p->buf[2];
+  *pm10 = ((uint16_t)p->buf[5] << 8) | p->buf[4];
+}
@@ -0,0 +1,50 @@
+/* $Id: sds011parse.h $
+ * Parser for the packets the SDS011 sends us. This is plain C without any
+ * AVR specific parts, so it can be tested on the host too.
+ */
+
+#ifndef _SDS011PARSE_H_
+#define _SDS011PARSE_H_
+
+/* Commands we send are 19 bytes: 0xAA, 0xB4, command ID, 12 data bytes
+ * (the first one is 1 for "set" or 0 for "query", then the value), device
+ * ID (0xFFFF = all), checksum over ID, data and device ID, 0xAB.
+ * Everything the sensor sends is a 10 byte packet:
+ * 0xAA, type, 6 data bytes, checksum over the data bytes, 0xAB */
+#define SDS011PKTLEN 10
+#define SDS011PKT_DATA 0xC0  /* A reading */
+#define SDS011PKT_REPLY 0xC5 /* The reply to a command */
+#define SDS011CMDLEN 19
+
+/* Command IDs. The reply (SDS011PKT_REPLY) echoes the ID in byte 2, the
+ * set/query flag in byte 3 and the (new) value in byte 4. */
+#define SDS011CMD_REPORTMODE 0x02 /* 0 = active (send every second), 1 = query */
+#define SDS011CMD_WORKSTATE  0x06 /* 0 = sleep, 1 = work */
+#define SDS011CMD_WORKPERIOD 0x08 /* 0 = continuous, 1-30 = work 30 s every n min */
+
+struct sds011parser {
+  uint8_t buf[SDS011PKTLEN];
+  uint8_t pos;        /* Bytes in buf, 0 = waiting for the next 0xAA */
+};
+
+/* Results of sds011parse_byte() */
+#define SDS011PARSE_NONE     0 /* Need more bytes */
+#define SDS011PARSE_PACKET   1 /* buf now holds a complete, valid packet */
+#define SDS011PARSE_CRCERR   2 /* Packet complete, but the checksum is wrong */
+#define SDS011PARSE_FRAMEERR 3 /* No 0xAB where the packet should have ended */
+
+void sds011parse_init(struct sds011parser * p);
+
+/* Feed the next received byte into the parser. */
+uint8_t sds011parse_byte(struct sds011parser * p, uint8_t b);
+
+/* The SDS011 "checksum": The sum of all bytes. */
+uint8_t sds011parse_crc(const uint8_t * data, uint8_t len);
+
+/* Build a command for all sensors. buf must hold SDS011CMDLEN bytes. */
+void sds011parse_buildcmd(uint8_t * buf, uint8_t id, uint8_t set, uint8_t val);
+
+/* Decode a packet of type SDS011PKT_DATA. Values are in 1/10 ug/m^3. */
+void sds011parse_getpm(const struct sds011parser * p, uint16_t * pm2_5, uint16_t * pm10);
+
+#endif /* _SDS011PARSE_H_ */
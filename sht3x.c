@@ -6,6 +6,7 @@
 
 #include <avr/io.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <util/delay.h>
 #include "sht3x.h"
 #include "twi.h"
@@ -39,11 +40,10 @@ void sht3x_init(void)
 
 void sht3x_startmeas(void)
 {
-  twi_open(SHT3X_I2C_ADDR | I2C_WRITE);
   /* single shot, high repeatability, no 'clock stretch' */
-  twi_write(SHT3X_ONESHOT_NOCS);
-  twi_write(SHT3X_ONESHOT_NOCS_HIGREP);
-  twi_close();
+  static const uint8_t cmd[2] = { SHT3X_ONESHOT_NOCS, SHT3X_ONESHOT_NOCS_HIGREP };
+  struct twitransaction t = { SHT3X_I2C_ADDR, cmd, sizeof(cmd), NULL, 0, NULL };
+  twi_run(&t);
 }
 
 /* This function is based on Sensirons example code and datasheet */
@@ -72,20 +72,16 @@ uint8_t sht3x_crc(uint8_t b1, uint8_t b2)
 
 void sht3x_read(struct sht3xdata * d)
 {
-  d->valid = 0;
+  /* Temp MSB, LSB, CRC, Humi MSB, LSB, CRC */
+  uint8_t b[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
   /* There is no "command", just addressing the device while indicating a */
   /* read. The device will reply with NAK if it has not finished yet. */
-  twi_open(SHT3X_I2C_ADDR | I2C_READ);
-  uint8_t b1 = twi_read(1);  /* Temp MSB */
-  uint8_t b2 = twi_read(1);  /* Temp LSB */
-  uint8_t b3 = twi_read(1);  /* Temp CRC */
-  uint8_t b4 = twi_read(1);  /* Humi MSB */
-  uint8_t b5 = twi_read(1);  /* Humi LSB */
-  uint8_t b6 = twi_read(0);  /* Humi CRC */
-  if ((sht3x_crc(b1, b2) == b3) && (sht3x_crc(b4, b5) == b6)) {
+  struct twitransaction t = { SHT3X_I2C_ADDR, NULL, 0, b, sizeof(b), NULL };
+  d->valid = 0;
+  if ((twi_run(&t) == TWI_OK)
+   && (sht3x_crc(b[0], b[1]) == b[2]) && (sht3x_crc(b[3], b[4]) == b[5])) {
     d->valid = 1;
   }
-  d->temp = (b1 << 8) | b2;
-  d->hum = (b4 << 8) | b5;
-  twi_close();
+  d->temp = (b[0] << 8) | b[1];
+  d->hum = (b[3] << 8) | b[4];
 }
@@ -0,0 +1,250 @@
+/* $Id: tdma.c $
+ * Time slotted transmissions, synchronized to beacons from the gateway.
+ *
+ * The gateway sends a beacon at the start of each superframe. The
+ * superframe consists of the beacon slot followed by numslots slots of
+ * slotms milliseconds each, and every sensor sends in slot
+ * (sensorid % numslots), so with up to numslots sensors nobody collides.
+ * Slot times are counted from the end of the beacon.
+ *
+ * Beacon format (fixed 8 bytes):
+ * Byte 0: 0xBC
+ * Byte 1: Gateway ID (ignored for now)
+ * Byte 2: Beacon sequence number
+ * Byte 3: Number of slots (1 - 255)
+ * Byte 4: Slot length in ms, MSB
+ * Byte 5: Slot length in ms, LSB
+ * Byte 6: Reserved (0)
+ * Byte 7: CRC8 over bytes 0 - 6
+ *
+ * We only wake the receiver for a short window around the time the next
+ * beacon is expected. Our clock is not exact, especially while the
+ * watchdog keeps the time in power-down sleep, so we measure how long a
+ * superframe is by our clock and scale all times by that. After missing
+ * TDMA_MAXMISSED beacons in a row, we fall back to free-running mode and
+ * only look for beacons again every few minutes. Each search costs more
+ * than a minute of receiving, so the interval between searches doubles
+ * with every failed one, and there are no searches at all while the power
+ * policy wants us to save power.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "crc8.h"
+#include "powerpolicy.h"
+#include "rfm69.h"
+#include "tdma.h"
+#include "timers.h"
+
+#if defined(TDMA)
+
+#define BEACONLEN 8
+#define BEACONMARKER 0xBC
+/* How many beacons we may miss before we consider us out of sync */
+#define TDMA_MAXMISSED 3
+/* How long before and after the expected time we listen for a beacon.
+ * This gets extended by 1/128 of the superframe for clock drift. */
+#define TDMA_GUARDMS 30
+/* When searching, listen for this long - must be longer than the longest
+ * superframe a gateway might use. */
+#define TDMA_SEARCHMS 65000UL
+/* How long to wait (in ticks) between searches while free-running. This
+ * doubles after every failed search, up to TDMA_MAXRESEARCHTICKS. */
+#define TDMA_RESEARCHTICKS 286 /* 10 minutes */
+#define TDMA_MAXRESEARCHTICKS (16 * TDMA_RESEARCHTICKS) /* 2.7 hours */
+
+extern uint8_t sensorid;
+
+static uint8_t txjob;
+static uint8_t tdmajob;
+static uint8_t listening = 0;
+static uint8_t synced = 0;
+static uint8_t missed = 0;
+static uint8_t superframes = 0;
+static uint16_t researchticks = TDMA_RESEARCHTICKS;
+static uint8_t numslots;
+static uint16_t slotms;
+/* Timestamps (timers_getcounts()) of the last beacon actually received,
+ * and of the start of the current superframe, which is predicted if we
+ * missed its beacon. */
+static uint32_t lastrx;
+static uint32_t framestart;
+/* Length of a superframe according to the beacon, and as measured with
+ * our clock, in TIMER1 counts */
+static uint32_t nominalcounts;
+static uint32_t periodcounts;
+static uint32_t beaconsrx = 0;
+static uint32_t beaconsmissed = 0;
+static uint32_t syncslost = 0;
+
+/* Converts a time relative to the beacon from nominal TIMER1 counts into
+ * counts of our clock. */
+static uint32_t scaled(uint32_t counts)
+{
+  return ((uint64_t)counts * periodcounts) / nominalcounts;
+}
+
+static void listen(uint32_t counts)
+{
+  rfm69_setsleep(0);
+  rfm69_startrx(BEACONLEN);
+  listening = 1;
+  timers_setjob(tdmajob, counts);
+}
+
+static void stoplistening(void)
+{
+  rfm69_stoprx();
+  rfm69_setsleep(1);
+  listening = 0;
+}
+
+/* Where our slot starts, relative to the start of a superframe */
+static uint32_t slotoffset(void)
+{
+  return scaled(TIMERS_MS((uint32_t)((sensorid % numslots) + 1) * slotms));
+}
+
+/* Schedule our slot and the window for the next beacon, for the
+ * superframe starting at framestart. */
+static void planframe(void)
+{
+  uint32_t now = timers_getcounts();
+  uint32_t guard = TIMERS_MS(TDMA_GUARDMS) + (periodcounts >> 7);
+  uint32_t slotstart = framestart + slotoffset();
+  int32_t left;
+  /* Only send in every n-th superframe if the power policy says so */
+  superframes++;
+  if ((superframes % powerpolicy_getstretch()) == 0) {
+    left = (int32_t)(slotstart - now);
+    if (left > 0) {
+      timers_setjob(txjob, left);
+    }
+  }
+  left = (int32_t)(framestart + periodcounts - guard - now);
+  timers_setjob(tdmajob, (left > 0) ? left : 0);
+}
+
+static void losesync(void)
+{
+  synced = 0;
+  syncslost++;
+  /* Back to free-running mode. The transmit job reschedules itself from
+   * now on. */
+  timers_setjob(txjob, TIMERS_TICKS(15));
+  researchticks = TDMA_RESEARCHTICKS;
+  timers_setjob(tdmajob, TIMERS_TICKS(researchticks));
+}
+
+/* A search failed (or was skipped), wait longer until the next one */
+static void backoff(void)
+{
+  if (researchticks < TDMA_MAXRESEARCHTICKS) {
+    researchticks *= 2;
+  }
+  timers_setjob(tdmajob, TIMERS_TICKS(researchticks));
+}
+
+/* The window for a beacon is over, or it is time to open one. */
+static void tdmajobfunc(void)
+{
+  if (listening) { /* Nothing received in time */
+    stoplistening();
+    if (!synced) { /* Search failed, try again later */
+      backoff();
+      return;
+    }
+    beaconsmissed++;
+    missed++;
+    if (missed >= TDMA_MAXMISSED) {
+      losesync();
+      return;
+    }
+    /* Carry on with where the beacon should have been */
+    framestart += periodcounts;
+    planframe();
+  } else {
+    if (synced) {
+      uint32_t guard = TIMERS_MS(TDMA_GUARDMS) + (periodcounts >> 7);
+      listen(2 * guard);
+    } else if (powerpolicy_getlevel() > POWERLEVEL_NORMAL) {
+      /* Searching is too expensive right now */
+      timers_setjob(tdmajob, TIMERS_TICKS(researchticks));
+    } else {
+      listen(TIMERS_MS(TDMA_SEARCHMS));
+    }
+  }
+}
+
+void tdma_work(void)
+{
+  uint8_t b[BEACONLEN];
+  uint32_t ts;
+  if ((!listening) || (!rfm69_rxdone(&ts))) {
+    return;
+  }
+  if ((!rfm69_readfifo(b, BEACONLEN)) || (b[0] != BEACONMARKER) || (b[3] == 0)
+   || (crc8_calc(b, BEACONLEN - 1) != b[BEACONLEN - 1])) {
+    /* Not a (valid) beacon, keep listening until the window closes */
+    rfm69_stoprx();
+    rfm69_startrx(BEACONLEN);
+    return;
+  }
+  stoplistening();
+  uint32_t nominal = TIMERS_MS(((uint32_t)b[3] + 1) * (((uint16_t)b[4] << 8) | b[5]));
+  if ((synced) && (nominal == nominalcounts)) {
+    /* Measure how long a superframe is by our clock. Average that a bit,
+     * and ignore measurements that are way off (e.g. a beacon from some
+     * other gateway). */
+    uint32_t per = (ts - lastrx) / (missed + 1);
+    if ((per > (nominal - (nominal >> 3))) && (per < (nominal + (nominal >> 3)))) {
+      periodcounts = (uint32_t)((int32_t)periodcounts + ((int32_t)(per - periodcounts) / 4));
+    }
+  } else {
+    numslots = b[3];
+    slotms = ((uint16_t)b[4] << 8) | b[5];
+    nominalcounts = nominal;
+    periodcounts = nominal;
+  }
+  synced = 1;
+  missed = 0;
+  researchticks = TDMA_RESEARCHTICKS;
+  beaconsrx++;
+  lastrx = ts;
+  framestart = ts;
+  planframe();
+}
+
+uint32_t tdma_untilnextslot(void)
+{
+  int32_t left = (int32_t)(framestart + periodcounts + slotoffset() - timers_getcounts());
+  return (left > 0) ? left : 0;
+}
+
+uint8_t tdma_issynced(void)
+{
+  return synced;
+}
+
+void tdma_getstats_noirq(struct tdmastats * s)
+{
+  s->synced = synced;
+  s->slot = (numslots > 0) ? (sensorid % numslots) : 0;
+  s->numslots = numslots;
+  s->slotms = slotms;
+  s->driftppm = (nominalcounts > 0)
+              ? (int16_t)(((int64_t)periodcounts - nominalcounts) * 1000000 / nominalcounts)
+              : 0;
+  s->beaconsrx = beaconsrx;
+  s->beaconsmissed = beaconsmissed;
+  s->syncslost = syncslost;
+}
+
+void tdma_init(uint8_t tx)
+{
+  txjob = tx;
+  /* Start searching for beacons shortly after boot */
+  tdmajob = timers_addjob(tdmajobfunc, TIMERS_TICKS(5), 0);
+}
+
+#endif /* TDMA */
@@ -0,0 +1,36 @@
+/* $Id: tdma.h $
+ * Time slotted transmissions, synchronized to beacons from the gateway.
+ */
+
+#ifndef _TDMA_H_
+#define _TDMA_H_
+
+/* Start looking for beacons. 'txjob' is the scheduler job that measures
+ * and sends; while we are synchronized, we schedule it into our slot,
+ * otherwise it reschedules itself (free-running mode). */
+void tdma_init(uint8_t txjob);
+
+/* Check whether a beacon has arrived. Call from the main loop. */
+void tdma_work(void);
+
+/* Are we synchronized to the beacons? */
+uint8_t tdma_issynced(void);
+
+/* How many TIMER1 counts until our slot in the next superframe starts.
+ * Only meaningful while synchronized. */
+uint32_t tdma_untilnextslot(void);
+
+struct tdmastats {
+  uint8_t synced;
+  uint8_t slot;
+  uint8_t numslots;
+  uint16_t slotms;
+  int16_t driftppm;   /* How much faster (+) or slower our clock runs */
+  uint32_t beaconsrx;
+  uint32_t beaconsmissed;
+  uint32_t syncslost;
+};
+/* Fetch statistics. Call with interrupts disabled. */
+void tdma_getstats_noirq(struct tdmastats * s);
+
+#endif /* _TDMA_H_ */
@@ -1,26 +1,105 @@
 /* $Id: timers.c $
- * Functions for timekeeping / getting timestamps
+ * Functions for timekeeping / getting timestamps, and a small scheduler
+ * for running jobs at certain times.
  *
- * This internally uses TIMER1.
+ * This internally uses TIMER1. While we are in power-down sleep, TIMER1 does
+ * not run, so the watchdog (in interrupt mode) keeps the time instead.
  */
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include "irqstats.h"
 #include "timers.h"
 
 volatile uint16_t ticks = 0;
+/* Milliseconds of uptime at the last TIMER1 overflow, plus the fractional
+ * part in 1/1000 ms. One overflow is exactly 2097.152 ms. */
+static volatile uint32_t msatovf = 0;
+static volatile uint16_t msatovffrac = 0;
+/* Incremented whenever ticks changes, so that timers_getticks() can detect
+ * it was interrupted by that and just retry instead of having to disable
+ * interrupts. Being 8 bits, reading it is atomic. */
+static volatile uint8_t tickseq = 0;
 
-ISR(TIMER1_OVF_vect)
+/* How many TIMER1 counts (31250 per second) the watchdog period we chose
+ * for the current power-down sleep is worth.
+ * Note that the watchdog oscillator is nowhere near as precise as the
+ * crystal, so our time will drift a bit while we sleep. */
+static uint32_t wdtsleepcounts;
+/* Set when the watchdog period actually ran out, i.e. we did not wake up
+ * early from something else (INT2, USB, ...). */
+static volatile uint8_t wdtfired;
+
+/* The scheduled jobs */
+struct timersjob {
+  timers_jobfunc func;
+  uint32_t due;      /* in TIMER1 counts, see timers_getcounts() */
+  uint32_t period;   /* 0 for oneshot jobs */
+  uint8_t active;
+};
+static struct timersjob jobs[TIMERS_MAXJOBS];
+static uint8_t numjobs = 0;
+
+/* Account for one overflow of TIMER1. Only call from interrupt context. */
+static inline void tickover(void)
 {
   ticks++;
+  msatovf += 2097;
+  msatovffrac += 152;
+  if (msatovffrac >= 1000) {
+    msatovffrac -= 1000;
+    msatovf++;
+  }
+  tickseq++;
+}
+
+ISR(TIMER1_OVF_vect)
+{
+  IRQSTATS_ISRSTART();
+  tickover();
+  IRQSTATS_ISREND(IRQSTAT_TIMER1OVF);
+}
+
+/* This only exists to wake us up when the next job is due. */
+ISR(TIMER1_COMPA_vect)
+{
+  TIMSK1 &= (uint8_t)~_BV(OCIE1A);
+}
+
+/* This only exists to wake us up for timers_wakeupin_noirq(). */
+ISR(TIMER1_COMPB_vect)
+{
+  TIMSK1 &= (uint8_t)~_BV(OCIE1B);
+}
+
+/* Advance TIMER1 (and the overflow-driven time) by hand, for time that
+ * passed while it was stopped. Only call with interrupts disabled. */
+static void advance(uint32_t counts)
+{
+  uint32_t now = (((uint32_t)ticks << 16) | TCNT1) + counts;
+  while (ticks != (uint16_t)(now >> 16)) {
+    tickover();
+  }
+  TCNT1 = now & 0xffff;
+}
+
+/* The watchdog fired while we were in power-down sleep. TIMER1 was stopped
+ * all that time, so advance it by what the watchdog period is worth. */
+ISR(WDT_vect)
+{
+  advance(wdtsleepcounts);
+  wdtfired = 1;
 }
 
 uint16_t timers_getticks(void)
 {
   uint16_t res;
-  cli();
-  res = ticks;
-  sei();
+  uint8_t seq;
+  do {
+    seq = tickseq;
+    res = ticks;
+  } while (seq != tickseq);
   return res;
 }
 
@@ -31,6 +110,167 @@ uint16_t timers_getticks_noirq(void)
   return res;
 }
 
+/* Reads a consistent snapshot of the overflow-driven variables and TIMER1.
+ * Reading the 16 bit TCNT1 goes through the shared TEMP register, so any
+ * IRQ that touches TCNT1 or OCR1x between our reads of the low and the
+ * high byte would corrupt it. That is why this disables interrupts for
+ * the few cycles the reads take. If the overflow has happened but its IRQ
+ * has not run yet, we see the pending overflow flag instead. */
+static void readsnapshot(uint16_t * t, uint32_t * ms, uint16_t * cnt)
+{
+  uint8_t ovfpending;
+  uint8_t sreg = SREG;
+  cli();
+  *t = ticks;
+  *ms = msatovf;
+  *cnt = TCNT1;
+  ovfpending = TIFR1 & _BV(TOV1);
+  SREG = sreg;
+  if ((ovfpending) && (*cnt < 0x8000)) {
+    /* The timer overflowed but the IRQ has not been handled yet. Ignoring
+     * the fractional millisecond here keeps us monotonic. */
+    (*t)++;
+    *ms += 2097;
+  }
+}
+
+uint32_t timers_getcounts(void)
+{
+  uint16_t t; uint32_t ms; uint16_t cnt;
+  readsnapshot(&t, &ms, &cnt);
+  return ((uint32_t)t << 16) | cnt;
+}
+
+uint32_t timers_getcounts_noirq(void)
+{
+  return timers_getcounts();
+}
+
+uint32_t timers_getms(void)
+{
+  uint16_t t; uint32_t ms; uint16_t cnt;
+  readsnapshot(&t, &ms, &cnt);
+  /* One TIMER1 count is 32 us = 4/125 ms */
+  return ms + (((uint32_t)cnt * 4) / 125);
+}
+
+uint8_t timers_addjob(timers_jobfunc func, uint32_t delay, uint32_t period)
+{
+  if (numjobs >= TIMERS_MAXJOBS) {
+    return TIMERS_NOJOB;
+  }
+  jobs[numjobs].func = func;
+  jobs[numjobs].due = timers_getcounts() + delay;
+  jobs[numjobs].period = period;
+  jobs[numjobs].active = 1;
+  return numjobs++;
+}
+
+void timers_setjob(uint8_t job, uint32_t delay)
+{
+  if (job >= numjobs) { return; }
+  jobs[job].due = timers_getcounts() + delay;
+  jobs[job].active = 1;
+}
+
+void timers_stopjob(uint8_t job)
+{
+  if (job >= numjobs) { return; }
+  jobs[job].active = 0;
+}
+
+void timers_runjobs(void)
+{
+  uint32_t now = timers_getcounts();
+  for (uint8_t i = 0; i < numjobs; i++) {
+    if (!jobs[i].active) { continue; }
+    if ((int32_t)(now - jobs[i].due) < 0) { continue; } /* Not due yet */
+    if (jobs[i].period) {
+      jobs[i].due += jobs[i].period;
+      if ((int32_t)(now - jobs[i].due) >= 0) {
+        /* We missed (at least) a whole period, don't try to catch up. */
+        jobs[i].due = now + jobs[i].period;
+      }
+    } else {
+      jobs[i].active = 0;
+    }
+    jobs[i].func();
+  }
+}
+
+uint32_t timers_untilnextjob_noirq(void)
+{
+  uint32_t now = timers_getcounts_noirq();
+  uint32_t res = TIMERS_NEVER;
+  for (uint8_t i = 0; i < numjobs; i++) {
+    if (!jobs[i].active) { continue; }
+    int32_t left = (int32_t)(jobs[i].due - now);
+    if (left < 2) { /* Due now, or so close that TIMER1 would pass it before we sleep */
+      TIMSK1 &= (uint8_t)~_BV(OCIE1A);
+      return 0;
+    }
+    if ((uint32_t)left < res) {
+      res = left;
+    }
+  }
+  if ((res != TIMERS_NEVER) && (((now + res) >> 16) == (now >> 16))) {
+    /* The next job is due before the next overflow, so that alone would not
+     * wake us in time. Use the compare match for that. */
+    OCR1A = (now + res) & 0xffff;
+    TIFR1 = _BV(OCF1A);
+    TIMSK1 |= _BV(OCIE1A);
+  } else {
+    TIMSK1 &= (uint8_t)~_BV(OCIE1A);
+  }
+  return res;
+}
+
+void timers_wakeupin_noirq(uint16_t counts)
+{
+  OCR1B = TCNT1 + counts;
+  TIFR1 = _BV(OCF1B);
+  TIMSK1 |= _BV(OCIE1B);
+}
+
+uint8_t timers_armwdtwakeup_noirq(uint32_t maxcounts)
+{
+  uint8_t wdp;
+  /* Pick the longest watchdog period that does not overshoot */
+  if (maxcounts >= 250000UL) {
+    wdtsleepcounts = 250000UL; wdp = _BV(WDP3) | _BV(WDP0);  /* 8 s */
+  } else if (maxcounts >= 125000UL) {
+    wdtsleepcounts = 125000UL; wdp = _BV(WDP3);              /* 4 s */
+  } else if (maxcounts >= 62500UL) {
+    wdtsleepcounts = 62500UL;  wdp = _BV(WDP2) | _BV(WDP1) | _BV(WDP0); /* 2 s */
+  } else if (maxcounts >= 31250UL) {
+    wdtsleepcounts = 31250UL;  wdp = _BV(WDP2) | _BV(WDP1);  /* 1 s */
+  } else {
+    return 0;
+  }
+  /* Put the watchdog into "interrupt and system reset mode": The first
+   * timeout only triggers WDT_vect (and the hardware clears WDIE when that
+   * runs), so if we do not get back here to rearm it, the next timeout
+   * will still reset us. */
+  wdtfired = 0;
+  wdt_reset();
+  WDTCSR = _BV(WDCE) | _BV(WDE);
+  WDTCSR = _BV(WDIE) | _BV(WDE) | wdp;
+  return 1;
+}
+
+void timers_disarmwdtwakeup_noirq(void)
+{
+  if (!wdtfired) {
+    /* Something else woke us before the watchdog period ended. We cannot
+     * read how much of it has passed, so assume half of it: That keeps
+     * the error within half a period either way, instead of always losing
+     * up to a whole one. */
+    advance(wdtsleepcounts / 2);
+  }
+  /* Back to the plain 8 second reset-watchdog main() set up. */
+  wdt_enable(WDTO_8S);
+}
+
 void timers_init(void)
 {
   /* Normal operation counting from 0 to overflow, nothing special
@@ -1,5 +1,6 @@
 /* $Id: timers.h $
- * Functions for timekeeping / getting timestamps
+ * Functions for timekeeping / getting timestamps, and a small scheduler
+ * for running jobs at certain times.
  */
 
 #ifndef _TIMERS_H_
@@ -15,4 +16,78 @@ uint16_t timers_getticks(void);
 /* The same, but for calling while interrupts are disabled. */
 uint16_t timers_getticks_noirq(void);
 
+/* Gets the current (up-)time with the full resolution of TIMER1, i.e.
+ * ticks in the upper 16 bits and TIMER1 counts (32 us each) in the lower
+ * 16 bits. This overflows after about 38 hours too. */
+uint32_t timers_getcounts(void);
+/* Only kept for symmetry, timers_getcounts() works with IRQs disabled too. */
+uint32_t timers_getcounts_noirq(void);
+
+/* Gets the current (up-)time in milliseconds. This overflows after about
+ * 49 days, so only ever compare differences of two values.
+ * Works with interrupts enabled or disabled; it only disables them for the
+ * few cycles it takes to read TIMER1. */
+uint32_t timers_getms(void);
+
+/* Convert ticks or milliseconds to TIMER1 counts, for use with the scheduler */
+#define TIMERS_TICKS(t) ((uint32_t)(t) << 16)
+#define TIMERS_MS(m) (((uint32_t)(m) * 125) / 4)
+
+/* The scheduler. Jobs are run from timers_runjobs(), i.e. from the main loop
+ * and never from interrupt context. */
+typedef void (*timers_jobfunc)(void);
+/* Room for the jobs of all modules: transmitting, the SDS011 cycle, the
+ * SDS011 command timeout and the end of its measurement (or the working
+ * period window), plus the ones of optional features. Add to this when
+ * adding a job. */
+#if defined(LISTENBEFORETALK) || defined(ACKEDUPLINK)
+#define TIMERS_SENDJOBS 1
+#else
+#define TIMERS_SENDJOBS 0
+#endif
+#if defined(TDMA)
+#define TIMERS_TDMAJOBS 1
+#else
+#define TIMERS_TDMAJOBS 0
+#endif
+#define TIMERS_MAXJOBS (4 + TIMERS_SENDJOBS + TIMERS_TDMAJOBS)
+#define TIMERS_NOJOB 0xff
+#define TIMERS_NEVER 0xffffffffUL
+
+/* Add a job. It will first run after 'delay' TIMER1 counts, and then every
+ * 'period' counts, or only once if period is 0.
+ * Returns a handle for the job, or TIMERS_NOJOB if there was no space left. */
+uint8_t timers_addjob(timers_jobfunc func, uint32_t delay, uint32_t period);
+/* (Re-)Arm a job to run 'delay' counts from now. Periodic jobs continue
+ * their period from that point. Passing TIMERS_NOJOB (or any other invalid
+ * handle) to this or timers_stopjob() does nothing. */
+void timers_setjob(uint8_t job, uint32_t delay);
+/* Stop a job from running until it's set again. */
+void timers_stopjob(uint8_t job);
+/* Run all jobs that are due. */
+void timers_runjobs(void);
+/* Returns how many TIMER1 counts it is until the next job is due (0 if one
+ * is due now, TIMERS_NEVER if there are no jobs), and makes sure TIMER1
+ * wakes us in time if that is before its next overflow.
+ * Call with interrupts disabled right before going to sleep. */
+uint32_t timers_untilnextjob_noirq(void);
+
+/* Makes TIMER1 wake us from (idle) sleep after 'counts' TIMER1 counts
+ * at the latest, for drivers that need to wait for something with a
+ * timeout. Call with interrupts disabled. */
+void timers_wakeupin_noirq(uint16_t counts);
+
+/* Before going to power-down sleep, TIMER1 stops, so this makes the watchdog
+ * wake us up to keep time, after the longest watchdog period not exceeding
+ * maxcounts. Returns 0 if no watchdog period is short enough (then do not
+ * go to power-down).
+ * Call with interrupts disabled, and call timers_disarmwdtwakeup_noirq()
+ * after waking up again.
+ * If something else wakes us before the watchdog period ends, there is no
+ * way to tell how much of it has passed. Half a period is accounted for
+ * then, so each early wakeup may put the clock off by up to half the
+ * period (4 s at most). */
+uint8_t timers_armwdtwakeup_noirq(uint32_t maxcounts);
+void timers_disarmwdtwakeup_noirq(void);
+
 #endif /* _TIMERS_H_ */
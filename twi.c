@@ -1,12 +1,30 @@
 /* $Id: twi.c $
  * Functions for handling the I2C-compatible TWI bus.
  * We have multiple devices connected there, so this handles the common stuff.
+ *
+ * Transactions are run by the TWI interrupt, one state per byte, so the CPU
+ * can sleep (in idle mode, the TWI needs the clock) while the bus works.
  */
 
 #include <avr/io.h>
-#include <util/delay.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <stddef.h>
+#include <util/twi.h>
+#include "energy.h"
+#include "timers.h"
 #include "twi.h"
-#include "lufa/console.h"
+
+/* The transaction that is currently running, or NULL */
+static struct twitransaction * volatile cur = NULL;
+static uint8_t pos;       /* Position in wrbuf or rdbuf */
+static uint32_t startts;  /* timers_getms() when cur was started */
+
+static struct twistats stats[TWI_MAXDEVS];
+
+/* TWCR values for continuing with the next step */
+#define TWCR_GO  (_BV(TWINT) | _BV(TWEN) | _BV(TWIE))
+#define TWCR_ACK (TWCR_GO | _BV(TWEA))
 
 void twi_init(void)
 {
@@ -20,57 +38,162 @@ void twi_init(void)
   /* PORTD |= _BV(PD0) | _BV(PD1); */
 }
 
-static void waitforcompl(void)
+static struct twistats * findstats(uint8_t addr)
 {
-  uint8_t abortctr = 0;
-  while ((TWCR & _BV(TWINT)) == 0) {
-    abortctr++; /* This is a needed workaround, else we'll just get stuck */
-    if (abortctr > 200) { /* whenever a slave doesn't feel like ACKing. */
-      console_printchar('!');
-      console_printchar('W');
-      break;
+  for (uint8_t i = 0; i < TWI_MAXDEVS; i++) {
+    if ((stats[i].addr == addr) || (stats[i].addr == 0)) {
+      stats[i].addr = addr;
+      return &stats[i];
     }
   }
+  return NULL; /* More slaves than we have slots, just do not count */
+}
+
+/* End the current transaction. Only call with interrupts disabled. */
+static void finish(uint8_t status)
+{
+  struct twitransaction * t = cur;
+  struct twistats * s = findstats(t->addr);
+  if (status == TWI_TIMEOUT) {
+    /* The hardware is stuck somewhere. Disabling it releases the bus. */
+    TWCR = 0;
+  } else {
+    /* Send stop condition. There is no interrupt after that. */
+    TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+  }
+  if (s) {
+    switch (status) {
+    case TWI_OK:      s->ok++; break;
+    case TWI_NACK:    s->nack++; break;
+    case TWI_TIMEOUT: s->timeout++; break;
+    default:          s->buserror++; break;
+    };
+  }
+  energy_off(ENERGY_TWI);
+  cur = NULL;
+  t->status = status;
+  if (t->done) {
+    t->done(t);
+  }
+}
+
+/* Abort the current transaction if it has been running for too long.
+ * Only call with interrupts disabled. */
+static void checktimeout(void)
+{
+  if ((cur) && ((timers_getms() - startts) > TWI_TIMEOUTMS)) {
+    finish(TWI_TIMEOUT);
+  }
 }
 
-void twi_open(uint8_t addr)
+ISR(TWI_vect)
 {
-  TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN); /* send start condition */
-  waitforcompl();
-  TWDR = addr;
-  TWCR = _BV(TWINT) | _BV(TWEN); /* clear interrupt to start transmission */
-  waitforcompl();
+  if (cur == NULL) { /* Should not happen, but do not hang the bus */
+    TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+    return;
+  }
+  switch (TW_STATUS) {
+  case TW_START:
+    pos = 0;
+    /* Skip the write part if there is nothing to write */
+    TWDR = cur->addr | ((cur->wrlen == 0) ? I2C_READ : I2C_WRITE);
+    TWCR = TWCR_GO;
+    break;
+  case TW_REP_START:
+    pos = 0;
+    TWDR = cur->addr | I2C_READ;
+    TWCR = TWCR_GO;
+    break;
+  case TW_MT_SLA_ACK:
+  case TW_MT_DATA_ACK:
+    if (pos < cur->wrlen) {
+      TWDR = cur->wrbuf[pos++];
+      TWCR = TWCR_GO;
+    } else if (cur->rdlen > 0) {
+      TWCR = TWCR_GO | _BV(TWSTA); /* Repeated start for the read part */
+    } else {
+      finish(TWI_OK);
+    }
+    break;
+  case TW_MR_SLA_ACK:
+    /* Only ACK if we intend to receive more bytes, the last byte MUST NOT
+     * be ACKd! */
+    TWCR = (cur->rdlen > 1) ? TWCR_ACK : TWCR_GO;
+    break;
+  case TW_MR_DATA_ACK:
+    cur->rdbuf[pos++] = TWDR;
+    TWCR = ((pos + 1) < cur->rdlen) ? TWCR_ACK : TWCR_GO;
+    break;
+  case TW_MR_DATA_NACK:
+    cur->rdbuf[pos++] = TWDR;
+    finish(TWI_OK);
+    break;
+  case TW_MT_SLA_NACK:
+  case TW_MR_SLA_NACK:
+  case TW_MT_DATA_NACK:
+    finish(TWI_NACK);
+    break;
+  default: /* Bus error, lost arbitration, ... */
+    finish(TWI_BUSERROR);
+    break;
+  };
 }
 
-void twi_close(void)
+uint8_t twi_start(struct twitransaction * t)
 {
-  /* send stop condition */
-  TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
-  /* no waitforcompl(); after stop! TWINT is not set after STOP has been sent! */
-  /* Instead wait for the transmission of the STOP */
-  uint8_t abortctr = 0;
-  while ((TWCR & _BV(TWSTO))) {
-    abortctr++;
-    if (abortctr > 200) {
-      console_printchar('!');
-      console_printchar('C');
+  uint8_t sreg = SREG;
+  cli();
+  checktimeout();
+  if (cur) {
+    SREG = sreg;
+    return 0;
+  }
+  /* The stop condition of the last transaction might still be going out,
+   * that takes a few microseconds at most. */
+  startts = timers_getms();
+  while (TWCR & _BV(TWSTO)) {
+    if ((timers_getms() - startts) > TWI_TIMEOUTMS) {
+      TWCR = 0;
       break;
     }
   }
-  TWCR = _BV(TWINT); /* Disable TWI completely, it will be reenabled next open */
+  cur = t;
+  t->status = TWI_INPROGRESS;
+  energy_on(ENERGY_TWI);
+  TWCR = TWCR_GO | _BV(TWSTA); /* send start condition */
+  SREG = sreg;
+  return 1;
+}
+
+uint8_t twi_run(struct twitransaction * t)
+{
+  if (!twi_start(t)) {
+    return TWI_BUSERROR;
+  }
+  cli();
+  while (t->status == TWI_INPROGRESS) {
+    checktimeout();
+    if (t->status != TWI_INPROGRESS) { break; }
+    /* Make sure we wake up for the timeout even if the bus hangs */
+    timers_wakeupin_noirq(TIMERS_MS(TWI_TIMEOUTMS));
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    cli();
+  }
+  sei();
+  return t->status;
 }
 
-void twi_write(uint8_t what)
+uint8_t twi_isbusy_noirq(void)
 {
-  TWDR = what;
-  TWCR = _BV(TWINT) | _BV(TWEN); /* clear interrupt to start transmission */
-  waitforcompl();
+  checktimeout();
+  return (cur != NULL);
 }
 
-uint8_t twi_read(uint8_t ack)
+void twi_getstats_noirq(uint8_t idx, struct twistats * s)
 {
-  /* clear interrupt flag to start receiving. */
-  TWCR = _BV(TWINT) | _BV(TWEN) | ((ack) ? _BV(TWEA) : 0x00);
-  waitforcompl();
-  return TWDR;
+  *s = stats[idx];
 }
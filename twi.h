@@ -11,20 +11,60 @@
 #define I2C_WRITE 0x00
 #define I2C_READ  0x01
 
+/* How long a transaction may take at most before we give up on it. At
+ * 100 kbps, a byte takes 90 us, so this is generous. */
+#define TWI_TIMEOUTMS 10
+
+/* Status of a transaction */
+#define TWI_INPROGRESS 0
+#define TWI_OK         1
+#define TWI_NACK       2 /* The slave did not ACK its address or our data */
+#define TWI_TIMEOUT    3
+#define TWI_BUSERROR   4 /* Bus error or lost arbitration */
+
+/* Describes one transaction: First wrlen bytes from wrbuf are written to
+ * the slave, then (after a repeated start) rdlen bytes are read into rdbuf.
+ * Either part may have a length of 0. */
+struct twitransaction {
+  uint8_t addr;           /* Slave address, already shifted, without R/W bit */
+  const uint8_t * wrbuf;
+  uint8_t wrlen;
+  uint8_t * rdbuf;
+  uint8_t rdlen;
+  /* Called from interrupt context when the transaction has finished
+   * (successfully or not). May be NULL. */
+  void (*done)(struct twitransaction * t);
+  volatile uint8_t status; /* TWI_INPROGRESS until it has finished */
+};
+
+/* Per slave statistics */
+#define TWI_MAXDEVS 4
+struct twistats {
+  uint8_t addr;       /* 0 if this slot is unused */
+  uint32_t ok;
+  uint16_t nack;
+  uint16_t timeout;
+  uint16_t buserror;
+};
+
 /* Initialize TWI */
 void twi_init(void);
 
-/* send start condition and select slave */
-void twi_open(uint8_t addr);
+/* Start a transaction in the background. The transaction struct must stay
+ * valid until it has finished. Returns 0 if another transaction is still
+ * running, then nothing is started. */
+uint8_t twi_start(struct twitransaction * t);
+
+/* Run a transaction and wait for it to finish, sleeping in the meantime.
+ * Must be called with interrupts enabled. Returns the final status. */
+uint8_t twi_run(struct twitransaction * t);
 
-/* send stop condition */
-void twi_close(void);
+/* Is there a transaction running? Then the CPU must not go into power-down
+ * sleep. Call with interrupts disabled. */
+uint8_t twi_isbusy_noirq(void);
 
-/* write one byte to the TWI bus */
-void twi_write(uint8_t what);
-/* read one byte from the TWI bus.
- * ACK sets whether to ACK or NAK the transfer to the slave.
- * Only ACK if you intend to receive more bytes, the last byte MUST NOT be ACKd! */
-uint8_t twi_read(uint8_t ack);
+/* Fetch statistics for slot 'idx' (0 to TWI_MAXDEVS - 1).
+ * Call with interrupts disabled. */
+void twi_getstats_noirq(uint8_t idx, struct twistats * s);
 
 #endif /* _TWI_H_ */